@@ -0,0 +1,139 @@
+//----------------------------------------------------------------------------
+// FX Project
+// Copyright (C) 2013 Anton Sazonov (lazybiz)
+//
+// Permission to copy, use, modify, sell and distribute this software 
+// is granted provided this copyright notice appears in all copies. 
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+// Contact: lazybiz@yandex.ru
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Bilinear image scaling for 32-bit pixels, 8-bit fixed point weights.
+// Two source rows are blended vertically into a line buffer first (four
+// pixels per step with SSE2), then every output pixel blends two
+// neighbours of that line; the line is reused while the source row pair
+// doesn't change, which is always the case for several rows when
+// upscaling. Scalar and SSE2 paths give identical results.
+//
+//----------------------------------------------------------------------------
+
+#ifndef __BILINEAR32_H__
+#define __BILINEAR32_H__
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+class bilinear32 {
+	std::vector <uint32_t>	m_line;		// vertically blended source row
+	std::vector <uint32_t>	m_xtab;		// per output column: x0 << 8 | weight of x0 + 1
+	std::vector <uint32_t>	m_ytab;		// the same per output row
+	int						m_src_w, m_src_h, m_dst_w, m_dst_h;
+
+	// sample position of output pixel i in 24.8 fixed point, centers aligned
+	static std::vector <uint32_t> table( int src, int dst ) {
+		std::vector <uint32_t> t( dst );
+		for ( int i = 0; i < dst; i++ ) {
+			int64_t s = ((2 * (int64_t)i + 1) * src * 256) / (2 * dst) - 128;
+			if ( s < 0 ) s = 0;
+			if ( s > (src - 1) * 256 ) s = (src - 1) * 256;
+			t[i] = (uint32_t)s;
+		}
+		return t;
+	}
+
+	static uint32_t lerp( uint32_t a, uint32_t b, uint32_t f ) {
+		uint32_t ag = (a >> 8) & 0x00ff00ff, ar = a & 0x00ff00ff;
+		uint32_t bg = (b >> 8) & 0x00ff00ff, br = b & 0x00ff00ff;
+		uint32_t rb = ((ar * (256 - f) + br * f) >> 8) & 0x00ff00ff;
+		uint32_t ga = (ag * (256 - f) + bg * f) & 0xff00ff00;
+		return rb | ga;
+	}
+
+	void blend_rows( const uint32_t *a, const uint32_t *b, uint32_t f, int n ) {
+		uint32_t *d = &m_line[0];
+		int i = 0;
+#if defined( __SSE2__ )
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i fb = _mm_set1_epi16( f );
+		const __m128i fa = _mm_set1_epi16( 256 - f );
+		for ( ; i + 4 <= n; i += 4 ) {
+			__m128i pa = _mm_loadu_si128( (const __m128i *)(a + i) );
+			__m128i pb = _mm_loadu_si128( (const __m128i *)(b + i) );
+			__m128i lo = _mm_add_epi16( _mm_mullo_epi16( _mm_unpacklo_epi8( pa, zero ), fa ), _mm_mullo_epi16( _mm_unpacklo_epi8( pb, zero ), fb ) );
+			__m128i hi = _mm_add_epi16( _mm_mullo_epi16( _mm_unpackhi_epi8( pa, zero ), fa ), _mm_mullo_epi16( _mm_unpackhi_epi8( pb, zero ), fb ) );
+			_mm_storeu_si128( (__m128i *)(d + i), _mm_packus_epi16( _mm_srli_epi16( lo, 8 ), _mm_srli_epi16( hi, 8 ) ) );
+		}
+#endif
+		for ( ; i < n; i++ ) d[i] = lerp( a[i], b[i], f );
+	}
+
+	// the line has one spare pixel at the end, so x0 + 1 is always valid
+	void blend_columns( uint32_t *dst, int n ) {
+		const uint32_t *s = &m_line[0];
+		const uint32_t *t = &m_xtab[0];
+		int i = 0;
+#if defined( __SSE2__ )
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i w256 = _mm_set1_epi16( 256 );
+		for ( ; i + 4 <= n; i += 4 ) {
+			// [a b] pairs of neighbours as 16-bit channels
+			__m128i p0 = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)(s + (t[i + 0] >> 8)) ), zero );
+			__m128i p1 = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)(s + (t[i + 1] >> 8)) ), zero );
+			__m128i p2 = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)(s + (t[i + 2] >> 8)) ), zero );
+			__m128i p3 = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)(s + (t[i + 3] >> 8)) ), zero );
+			__m128i f01 = _mm_unpacklo_epi64( _mm_set1_epi16( t[i + 0] & 255 ), _mm_set1_epi16( t[i + 1] & 255 ) );
+			__m128i f23 = _mm_unpacklo_epi64( _mm_set1_epi16( t[i + 2] & 255 ), _mm_set1_epi16( t[i + 3] & 255 ) );
+			__m128i r01 = _mm_add_epi16(
+				_mm_mullo_epi16( _mm_unpacklo_epi64( p0, p1 ), _mm_sub_epi16( w256, f01 ) ),
+				_mm_mullo_epi16( _mm_unpackhi_epi64( p0, p1 ), f01 ) );
+			__m128i r23 = _mm_add_epi16(
+				_mm_mullo_epi16( _mm_unpacklo_epi64( p2, p3 ), _mm_sub_epi16( w256, f23 ) ),
+				_mm_mullo_epi16( _mm_unpackhi_epi64( p2, p3 ), f23 ) );
+			_mm_storeu_si128( (__m128i *)(dst + i), _mm_packus_epi16( _mm_srli_epi16( r01, 8 ), _mm_srli_epi16( r23, 8 ) ) );
+		}
+#endif
+		for ( ; i < n; i++ ) {
+			int x0 = t[i] >> 8;
+			dst[i] = lerp( s[x0], s[x0 + 1], t[i] & 255 );
+		}
+	}
+
+public:
+	bilinear32() : m_src_w(0), m_src_h(0), m_dst_w(0), m_dst_h(0) {}
+
+	void process( const image <uint32_t> & src, image <uint32_t> & dst ) {
+		int sw = src.width(), sh = src.height();
+		int dw = dst.width(), dh = dst.height();
+		if ( sw != m_src_w || dw != m_dst_w ) {
+			m_xtab = table( sw, dw );
+			m_line.resize( sw + 1 );
+			m_src_w = sw;
+			m_dst_w = dw;
+		}
+		if ( sh != m_src_h || dh != m_dst_h ) {
+			m_ytab = table( sh, dh );
+			m_src_h = sh;
+			m_dst_h = dh;
+		}
+
+		uint32_t prev = ~0u;
+		for ( int y = 0; y < dh; y++ ) {
+			uint32_t sy = m_ytab[y];
+			if ( sy != prev ) {
+				int y0 = sy >> 8;
+				int y1 = y0 < sh - 1 ? y0 + 1 : y0;
+				blend_rows( src.row_ptr( y0 ), src.row_ptr( y1 ), sy & 255, sw );
+				m_line[sw] = m_line[sw - 1];
+				prev = sy;
+			}
+			blend_columns( dst.row_ptr( y ), dw );
+		}
+	}
+};
+
+#endif // __BILINEAR32_H__
@@ -0,0 +1,58 @@
+//----------------------------------------------------------------------------
+// FX Project
+// Copyright (C) 2013 Anton Sazonov (lazybiz)
+//
+// Permission to copy, use, modify, sell and distribute this software 
+// is granted provided this copyright notice appears in all copies. 
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+// Contact: lazybiz@yandex.ru
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Counter-based random numbers. Instead of a generator state advancing with
+// every draw, a value is a pure function of (seed, stream, counter) - the
+// SplitMix64 output mix applied to a Weyl sequence point. Any number of
+// threads can draw independent, reproducible values without sharing state:
+// e.g. stream = object id and counter = frame number.
+//
+//----------------------------------------------------------------------------
+
+#ifndef __COUNTER_RNG_H__
+#define __COUNTER_RNG_H__
+
+class counter_rng {
+	uint64_t	m_key;		// seed and stream
+	uint64_t	m_counter;	// upper 32 bits - the caller's counter, lower - draw index
+
+	static const uint64_t golden_gamma = 0x9e3779b97f4a7c15ull;
+
+public:
+	static uint64_t mix( uint64_t z ) {
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	counter_rng( uint64_t seed, uint32_t stream, uint32_t counter )
+		: m_key( mix( seed * golden_gamma + stream ) ), m_counter( (uint64_t)counter << 32 ) {}
+
+	uint32_t next() {
+		return mix( m_key + ++m_counter * golden_gamma ) >> 32;
+	}
+
+	// [min, max) in steps of 2^-24 of the range
+	float uniform( float min, float max ) {
+		float r = (next() >> 8) * (1.f / (1 << 24));
+		return r * (max - min) + min;
+	}
+
+	// [min, max]
+	int uniform_int( int min, int max ) {
+		return min + (int)(((uint64_t)next() * (uint32_t)(max - min + 1)) >> 32);
+	}
+};
+
+#endif // __COUNTER_RNG_H__
@@ -0,0 +1,117 @@
+//----------------------------------------------------------------------------
+// FX Project
+// Copyright (C) 2013 Anton Sazonov (lazybiz)
+//
+// Permission to copy, use, modify, sell and distribute this software 
+// is granted provided this copyright notice appears in all copies. 
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+// Contact: lazybiz@yandex.ru
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Anti-aliased disc rasterizer. Pixel (ix, iy) gets coverage r - distance
+// clamped to [0, 1]. Every row is split analytically into a solid inner span
+// (distance <= r - 1) which is filled in one go and two short edge runs
+// which are the only pixels paying for a square root, so the cost of a disc
+// grows with its perimeter rather than with its bounding box.
+//
+//----------------------------------------------------------------------------
+
+#ifndef __DISC_RASTER8_H__
+#define __DISC_RASTER8_H__
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+class disc_raster8 {
+
+	// "over" the alpha of whatever is already in the pixel
+	static void put( uint8_t *p, unsigned alpha ) {
+		*p += (255 - *p) * alpha / 255;
+	}
+
+	// pixels [ix0, ix1) of a row, all of them within the outer radius
+	static void edge_run( uint8_t *row, int ix0, int ix1, float x, float dy2, float r, unsigned a ) {
+		int ix = ix0;
+#if defined( __SSE2__ )
+		const __m128 v_r   = _mm_set1_ps( r );
+		const __m128 v_dy2 = _mm_set1_ps( dy2 );
+		const __m128 v_one = _mm_set1_ps( 1 );
+		const __m128 v_255 = _mm_set1_ps( 255 );
+		for ( ; ix + 4 <= ix1; ix += 4 ) {
+			__m128 dx = _mm_sub_ps( _mm_set1_ps( x ), _mm_setr_ps( ix, ix + 1, ix + 2, ix + 3 ) );
+			__m128 d  = fx_math::sqrt( _mm_add_ps( _mm_mul_ps( dx, dx ), v_dy2 ) );
+			__m128 rd = _mm_min_ps( _mm_max_ps( _mm_sub_ps( v_r, d ), _mm_setzero_ps() ), v_one );
+			int32_t cov[4];
+			_mm_storeu_si128( (__m128i *)cov, _mm_cvttps_epi32( _mm_mul_ps( rd, v_255 ) ) );
+			for ( int i = 0; i < 4; i++ ) {
+				if ( cov[i] ) put( row + ix + i, cov[i] * a / 255 );
+			}
+		}
+#endif
+		for ( ; ix < ix1; ix++ ) {
+			float dx = x - ix;
+			float d  = fx_math::sqrt( dx * dx + dy2 );	// rounded to float like in the SSE2 loop, x87 keeps more within an expression
+			float rd = r - d;
+			if ( rd <= 0 ) continue;
+			unsigned cov = rd < 1 ? (unsigned)(rd * 255) : 255;
+			put( row + ix, cov * a / 255 );
+		}
+	}
+
+	static int clip( int v, int lo, int hi ) { return v < lo ? lo : (v > hi ? hi : v); }
+
+public:
+	/* x and y can be out of bound; disc alpha (scaled by a / 255) is accumulated
+	   over img, the clipped bounding box goes to rc */
+	bool render( image <uint8_t> & img, float x, float y, float r, unsigned a, rect & rc ) {
+		rc.x0 = clip( floor( x - r ), 0, img.width() );
+		rc.y0 = clip( floor( y - r ), 0, img.height() );
+		rc.x1 = clip( ceil( x + r ), 0, img.width() );
+		rc.y1 = clip( ceil( y + r ), 0, img.height() );
+		if ( rc.x0 == rc.x1 || rc.y0 == rc.y1 ) return false;
+
+		float r2  = r * r;
+		float ri  = r - 1;	// radius of the solid core
+		float ri2 = ri > 0 ? ri * ri : 0;
+
+		for ( int iy = rc.y0; iy < rc.y1; iy++ ) {
+			float dy  = y - iy;
+			float dy2 = dy * dy;
+			if ( dy2 >= r2 ) continue;
+
+			// outer span: pixels with distance < r
+			float xo = fx_math::sqrt( r2 - dy2 );
+			int ex0 = clip( (int)floor( x - xo ) + 1, rc.x0, rc.x1 );
+			int ex1 = clip( (int)ceil( x + xo ), rc.x0, rc.x1 );
+
+			// inner span: pixels with distance <= r - 1
+			int sx0 = ex1, sx1 = ex1;
+			if ( dy2 < ri2 ) {
+				float xi = fx_math::sqrt( ri2 - dy2 );
+				sx0 = clip( (int)ceil( x - xi ), ex0, ex1 );
+				sx1 = clip( (int)floor( x + xi ) + 1, sx0, ex1 );
+				// the end columns lie right at r - 1, where xi's rounding may disagree with the
+				// distance of the pixel itself: they go through the edge test
+				sx0 = std::min( sx0 + 1, sx1 );
+				sx1 = std::max( sx1 - 1, sx0 );
+			}
+
+			uint8_t *row = img.row_ptr( iy );
+			edge_run( row, ex0, sx0, x, dy2, r, a );
+			if ( a >= 255 ) {
+				memset( row + sx0, 255, sx1 - sx0 );
+			} else {
+				for ( uint8_t *p = row + sx0; p < row + sx1; p++ ) put( p, a );
+			}
+			edge_run( row, sx1, ex1, x, dy2, r, a );
+		}
+		return true;
+	}
+};
+
+#endif // __DISC_RASTER8_H__
@@ -0,0 +1,62 @@
+//----------------------------------------------------------------------------
+// FX Project
+// Copyright (C) 2013 Anton Sazonov (lazybiz)
+//
+// Permission to copy, use, modify, sell and distribute this software 
+// is granted provided this copyright notice appears in all copies. 
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+// Contact: lazybiz@yandex.ru
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Dynamic resolution controller. Fed with the time spent on every frame it
+// picks the render scale for the next one, so that the frame time stays
+// within the budget. Render cost is taken as proportional to the pixel
+// count, i.e. to scale^2, plus a fixed part which doesn't shrink with the
+// scale (the upscale to the window); the scale moves in 1/16 steps and
+// only when the smoothed frame time leaves a dead zone around the budget,
+// so it doesn't flicker between two sizes.
+//
+//----------------------------------------------------------------------------
+
+#ifndef __DYNAMIC_RESOLUTION_H__
+#define __DYNAMIC_RESOLUTION_H__
+
+class dynamic_resolution {
+	double	m_budget_ms;
+	double	m_avg_ms;		// exponential moving average, scaled back to scale 1
+	double	m_fixed_ms;		// the same for the part of the frame not scaled
+	float	m_min_scale;
+	float	m_scale;
+
+public:
+	dynamic_resolution( double budget_ms, float min_scale = .25f )
+		: m_budget_ms(budget_ms), m_avg_ms(0), m_fixed_ms(0), m_min_scale(min_scale), m_scale(1) {}
+
+	float scale() const { return m_scale; }
+
+	// time of the frame rendered with scale(), split into the part which scales with the
+	// pixel count and the fixed one, returns the scale of the next one
+	float update( double render_ms, double fixed_ms = 0 ) {
+		double full_ms = render_ms / (m_scale * m_scale);
+		bool first = m_avg_ms <= 0;
+		m_avg_ms = first ? full_ms : m_avg_ms * .9 + full_ms * .1;
+		m_fixed_ms = first ? fixed_ms : m_fixed_ms * .9 + fixed_ms * .1;
+
+		double expected = m_avg_ms * m_scale * m_scale + m_fixed_ms;
+		if ( expected > m_budget_ms || expected < m_budget_ms * .7 ) {
+			double left = m_budget_ms * .85 - m_fixed_ms;	// for the scaled part
+			float s = left > 0 ? sqrt( left / m_avg_ms ) : 0;
+			s = floor( s * 16 ) / 16;
+			if ( s < m_min_scale ) s = m_min_scale;
+			if ( s > 1 ) s = 1;
+			m_scale = s;
+		}
+		return m_scale;
+	}
+};
+
+#endif // __DYNAMIC_RESOLUTION_H__
@@ -0,0 +1,248 @@
+//----------------------------------------------------------------------------
+// FX Project
+// Copyright (C) 2013 Anton Sazonov (lazybiz)
+//
+// Permission to copy, use, modify, sell and distribute this software 
+// is granted provided this copyright notice appears in all copies. 
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+// Contact: lazybiz@yandex.ru
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Frame sink: streams frames to a file or a pipe as raw RGBA or YUV4MPEG2
+// (4:2:0, full range BT.601, i.e. C420jpeg) for an encoder downstream.
+// A frame is converted into one of two buffers on the caller's thread and
+// written by a writer thread, so write() only waits when the writer is two
+// frames behind. A short write (disk full, pipe closed) stops the output,
+// failed() and finish() tell the caller.
+//
+//----------------------------------------------------------------------------
+
+#ifndef __FRAME_SINK_H__
+#define __FRAME_SINK_H__
+
+#include <io.h>
+#include <fcntl.h>
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+class frame_sink {
+public:
+	enum format { raw_rgba, y4m };
+
+private:
+	FILE *		m_file;
+	int			m_w, m_h;
+	format		m_format;
+	size_t		m_size;			// bytes per converted frame
+	uint8_t *	m_buffer[2];
+	int			m_put, m_get;
+	HANDLE		m_free;			// semaphore: buffers ready for conversion
+	HANDLE		m_full;			// semaphore: buffers ready for writing
+	HANDLE		m_thread;
+	volatile bool	m_quit;
+	volatile bool	m_failed;		// a write came up short, nothing is written after it
+
+	// fixed point (14 bits) BT.601 full range
+	enum {
+		y_r = 4899, y_g = 9617, y_b = 1868,
+		cb_r = -2765, cb_g = -5427, cb_b = 8192,
+		cr_r = 8192, cr_g = -6860, cr_b = -1332,
+		c_bias = (128 << 14) + (1 << 13)
+	};
+
+	static uint8_t luma( uint32_t c ) {
+		return (((c >> 16) & 255) * y_r + ((c >> 8) & 255) * y_g + (c & 255) * y_b + (1 << 13)) >> 14;
+	}
+
+	static void chroma( uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint8_t *u, uint8_t *v ) {
+		int r = ((((c0 >> 16) & 255) + ((c1 >> 16) & 255) + ((c2 >> 16) & 255) + ((c3 >> 16) & 255)) + 2) >> 2;
+		int g = ((((c0 >>  8) & 255) + ((c1 >>  8) & 255) + ((c2 >>  8) & 255) + ((c3 >>  8) & 255)) + 2) >> 2;
+		int b = (((c0 & 255) + (c1 & 255) + (c2 & 255) + (c3 & 255)) + 2) >> 2;
+		int cu = (r * cb_r + g * cb_g + b * cb_b + c_bias) >> 14;
+		int cv = (r * cr_r + g * cr_g + b * cr_b + c_bias) >> 14;
+		*u = cu > 255 ? 255 : cu;
+		*v = cv > 255 ? 255 : cv;
+	}
+
+	void to_rgba( const uint32_t *src, uint32_t *dst ) {
+		size_t n = (size_t)m_w * m_h, i = 0;
+#if defined( __SSE2__ )
+		const __m128i a  = _mm_set1_epi32( 0xff000000 );
+		const __m128i g  = _mm_set1_epi32( 0x0000ff00 );
+		const __m128i rb = _mm_set1_epi32( 0x000000ff );
+		for ( ; i + 4 <= n; i += 4 ) {
+			__m128i p = _mm_loadu_si128( (const __m128i *)(src + i) );
+			__m128i q = _mm_or_si128( _mm_or_si128( a, _mm_and_si128( p, g ) ),
+				_mm_or_si128( _mm_and_si128( _mm_srli_epi32( p, 16 ), rb ), _mm_slli_epi32( _mm_and_si128( p, rb ), 16 ) ) );
+			_mm_storeu_si128( (__m128i *)(dst + i), q );
+		}
+#endif
+		for ( ; i < n; i++ ) {
+			uint32_t p = src[i];
+			dst[i] = 0xff000000 | (p & 0xff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+		}
+	}
+
+	void to_yuv420( const uint32_t *src, uint8_t *dst ) {
+		int cw = (m_w + 1) / 2, ch = (m_h + 1) / 2;
+		uint8_t *py = dst;
+		uint8_t *pu = py + (size_t)m_w * m_h;
+		uint8_t *pv = pu + (size_t)cw * ch;
+
+		for ( int y = 0; y < m_h; y++ ) {
+			const uint32_t *s = src + (size_t)m_w * y;
+			uint8_t *d = py + (size_t)m_w * y;
+			int x = 0;
+#if defined( __SSE2__ )
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i k = _mm_setr_epi16( y_b, y_g, y_r, 0, y_b, y_g, y_r, 0 );
+			const __m128i round = _mm_set1_epi32( 1 << 13 );
+			for ( ; x + 8 <= m_w; x += 8 ) {
+				__m128i p0 = _mm_loadu_si128( (const __m128i *)(s + x) );
+				__m128i p1 = _mm_loadu_si128( (const __m128i *)(s + x + 4) );
+				__m128i y0 = sum_pairs( _mm_madd_epi16( _mm_unpacklo_epi8( p0, zero ), k ), _mm_madd_epi16( _mm_unpackhi_epi8( p0, zero ), k ) );
+				__m128i y1 = sum_pairs( _mm_madd_epi16( _mm_unpacklo_epi8( p1, zero ), k ), _mm_madd_epi16( _mm_unpackhi_epi8( p1, zero ), k ) );
+				y0 = _mm_srai_epi32( _mm_add_epi32( y0, round ), 14 );
+				y1 = _mm_srai_epi32( _mm_add_epi32( y1, round ), 14 );
+				_mm_storel_epi64( (__m128i *)(d + x), _mm_packus_epi16( _mm_packs_epi32( y0, y1 ), zero ) );
+			}
+#endif
+			for ( ; x < m_w; x++ ) d[x] = luma( s[x] );
+		}
+
+		for ( int y = 0; y < ch; y++ ) {
+			const uint32_t *s0 = src + (size_t)m_w * (2 * y);
+			const uint32_t *s1 = 2 * y + 1 < m_h ? s0 + m_w : s0;
+			uint8_t *u = pu + (size_t)cw * y;
+			uint8_t *v = pv + (size_t)cw * y;
+			int x = 0;
+#if defined( __SSE2__ )
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i ku = _mm_setr_epi16( cb_b, cb_g, cb_r, 0, cb_b, cb_g, cb_r, 0 );
+			const __m128i kv = _mm_setr_epi16( cr_b, cr_g, cr_r, 0, cr_b, cr_g, cr_r, 0 );
+			const __m128i two = _mm_set1_epi16( 2 );
+			const __m128i bias = _mm_set1_epi32( c_bias );
+			for ( ; 2 * x + 8 <= m_w; x += 4 ) {
+				__m128i a = _mm_loadu_si128( (const __m128i *)(s0 + 2 * x) );
+				__m128i b = _mm_loadu_si128( (const __m128i *)(s1 + 2 * x) );
+				__m128i c = _mm_loadu_si128( (const __m128i *)(s0 + 2 * x + 4) );
+				__m128i e = _mm_loadu_si128( (const __m128i *)(s1 + 2 * x + 4) );
+				// vertical sums, pixels 0 1 | 2 3 | 4 5 | 6 7
+				__m128i v01 = _mm_add_epi16( _mm_unpacklo_epi8( a, zero ), _mm_unpacklo_epi8( b, zero ) );
+				__m128i v23 = _mm_add_epi16( _mm_unpackhi_epi8( a, zero ), _mm_unpackhi_epi8( b, zero ) );
+				__m128i v45 = _mm_add_epi16( _mm_unpacklo_epi8( c, zero ), _mm_unpacklo_epi8( e, zero ) );
+				__m128i v67 = _mm_add_epi16( _mm_unpackhi_epi8( c, zero ), _mm_unpackhi_epi8( e, zero ) );
+				// horizontal sums and average, blocks 0 1 | 2 3
+				__m128i b01 = _mm_srli_epi16( _mm_add_epi16( _mm_add_epi16( _mm_unpacklo_epi64( v01, v23 ), _mm_unpackhi_epi64( v01, v23 ) ), two ), 2 );
+				__m128i b23 = _mm_srli_epi16( _mm_add_epi16( _mm_add_epi16( _mm_unpacklo_epi64( v45, v67 ), _mm_unpackhi_epi64( v45, v67 ) ), two ), 2 );
+				__m128i cu = _mm_srai_epi32( _mm_add_epi32( sum_pairs( _mm_madd_epi16( b01, ku ), _mm_madd_epi16( b23, ku ) ), bias ), 14 );
+				__m128i cv = _mm_srai_epi32( _mm_add_epi32( sum_pairs( _mm_madd_epi16( b01, kv ), _mm_madd_epi16( b23, kv ) ), bias ), 14 );
+				__m128i uv = _mm_packus_epi16( _mm_packs_epi32( cu, cv ), zero );
+				*(uint32_t *)(u + x) = _mm_cvtsi128_si32( uv );
+				*(uint32_t *)(v + x) = _mm_cvtsi128_si32( _mm_srli_si128( uv, 4 ) );
+			}
+#endif
+			for ( ; x < cw; x++ ) {
+				int x1 = 2 * x + 1 < m_w ? 2 * x + 1 : 2 * x;
+				chroma( s0[2 * x], s0[x1], s1[2 * x], s1[x1], u + x, v + x );
+			}
+		}
+	}
+
+#if defined( __SSE2__ )
+	// [a0 b0 a1 b1], [a2 b2 a3 b3] -> [a0+b0 a1+b1 a2+b2 a3+b3]
+	static __m128i sum_pairs( __m128i m0, __m128i m1 ) {
+		__m128 f0 = _mm_castsi128_ps( m0 ), f1 = _mm_castsi128_ps( m1 );
+		return _mm_add_epi32( _mm_castps_si128( _mm_shuffle_ps( f0, f1, _MM_SHUFFLE( 2, 0, 2, 0 ) ) ),
+			_mm_castps_si128( _mm_shuffle_ps( f0, f1, _MM_SHUFFLE( 3, 1, 3, 1 ) ) ) );
+	}
+#endif
+
+	static DWORD WINAPI writer_proc( LPVOID param ) {
+		frame_sink *p = (frame_sink *)param;
+		for ( ; ; ) {
+			WaitForSingleObject( p->m_full, INFINITE );
+			if ( p->m_quit ) break;
+			if ( !p->m_failed ) {
+				bool ok = p->m_format != y4m || fputs( "FRAME\n", p->m_file ) >= 0;
+				ok = ok && fwrite( p->m_buffer[p->m_get], 1, p->m_size, p->m_file ) == p->m_size;
+				if ( !ok ) p->m_failed = true;
+			}
+			p->m_get ^= 1;
+			ReleaseSemaphore( p->m_free, 1, NULL );
+		}
+		return 0;
+	}
+
+public:
+	frame_sink( FILE * file, int w, int h, int fps, format fmt )
+		: m_file(file), m_w(w), m_h(h), m_format(fmt), m_put(0), m_get(0), m_quit(false), m_failed(false) {
+		if ( m_format == y4m ) {
+			m_size = (size_t)w * h + 2 * (size_t)((w + 1) / 2) * ((h + 1) / 2);
+			m_failed = fprintf( m_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", w, h, fps ) < 0;
+		} else {
+			m_size = (size_t)w * h * 4;
+		}
+		m_buffer[0] = new uint8_t [m_size];
+		m_buffer[1] = new uint8_t [m_size];
+		m_free = CreateSemaphore( NULL, 2, 2, NULL );
+		m_full = CreateSemaphore( NULL, 0, 2, NULL );
+		m_thread = CreateThread( NULL, 0, writer_proc, this, 0, NULL );
+	}
+
+	// "-" is stdout
+	static FILE * open( const char * path ) {
+		if ( !strcmp( path, "-" ) ) {
+			_setmode( _fileno( stdout ), _O_BINARY );
+			return stdout;
+		}
+		return fopen( path, "wb" );
+	}
+
+	// true once a write came up short, later frames are dropped
+	bool failed() const { return m_failed; }
+
+	// writes frames in flight and flushes the file, false if anything was lost
+	bool finish() {
+		WaitForSingleObject( m_free, INFINITE );
+		WaitForSingleObject( m_free, INFINITE );
+		ReleaseSemaphore( m_free, 2, NULL );
+		if ( !m_failed && fflush( m_file ) ) m_failed = true;
+		return !m_failed;
+	}
+
+	// flushes frames in flight
+	~frame_sink() {
+		finish();
+		WaitForSingleObject( m_free, INFINITE );
+		WaitForSingleObject( m_free, INFINITE );
+		m_quit = true;
+		ReleaseSemaphore( m_full, 1, NULL );
+		WaitForSingleObject( m_thread, INFINITE );
+		CloseHandle( m_thread );
+		CloseHandle( m_full );
+		CloseHandle( m_free );
+		delete [] m_buffer[0];
+		delete [] m_buffer[1];
+	}
+
+	// frame is w x h, 0x00RRGGBB pixels without padding
+	void write( const uint32_t * frame ) {
+		WaitForSingleObject( m_free, INFINITE );
+		if ( m_format == y4m ) {
+			to_yuv420( frame, m_buffer[m_put] );
+		} else {
+			to_rgba( frame, (uint32_t *)m_buffer[m_put] );
+		}
+		m_put ^= 1;
+		ReleaseSemaphore( m_full, 1, NULL );
+	}
+};
+
+#endif // __FRAME_SINK_H__
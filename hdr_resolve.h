@@ -0,0 +1,131 @@
+//----------------------------------------------------------------------------
+// FX Project
+// Copyright (C) 2013 Anton Sazonov (lazybiz)
+//
+// Permission to copy, use, modify, sell and distribute this software 
+// is granted provided this copyright notice appears in all copies. 
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+// Contact: lazybiz@yandex.ru
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// HDR resolve: linear float RGB (4 floats a pixel: r, g, b and an unused one)
+// to 32-bit pixels. Every channel is scaled (exposure times the weight of the
+// accumulated samples), tone mapped to [0, 1] and encoded either linearly,
+// (int)(v * 255) as abc::rgb32() does, or as sRGB through a table indexed by
+// the value in 12 bits. Four pixels a step with SSE2, the scalar path does the
+// same float operations.
+//
+//----------------------------------------------------------------------------
+
+#ifndef __HDR_RESOLVE_H__
+#define __HDR_RESOLVE_H__
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+class hdr_resolve {
+public:
+	enum tone_map {
+		tm_clamp,		// none, clipped at 1
+		tm_reinhard,	// v / (1 + v)
+		tm_aces,		// filmic curve, Narkowicz's fit of the ACES reference
+		tm_count
+	};
+
+private:
+	enum { lut_bits = 12, lut_size = 1 << lut_bits };
+
+	float		m_exposure;
+	tone_map	m_tone_map;
+	bool		m_srgb;
+	uint8_t		m_lut[lut_size];	// v * (lut_size - 1) -> 8-bit sRGB
+
+	float map( float v, float scale ) const {
+		v = v * scale;
+		v = v > 0 ? v : 0;
+		if ( m_tone_map == tm_reinhard ) v = v / (1 + v);
+		if ( m_tone_map == tm_aces ) v = (v * (2.51f * v + .03f)) / (v * (2.43f * v + .59f) + .14f);
+		return v < 1 ? v : 1;
+	}
+
+	unsigned encode( float v ) const {
+		return m_srgb ? m_lut[(int)(v * (lut_size - 1) + .5f)] : (int)(v * 255);
+	}
+
+#if defined( __SSE2__ )
+	__m128 map( __m128 v, __m128 scale ) const {
+		const __m128 one = _mm_set1_ps( 1 );
+		v = _mm_max_ps( _mm_mul_ps( v, scale ), _mm_setzero_ps() );
+		if ( m_tone_map == tm_reinhard ) v = _mm_div_ps( v, _mm_add_ps( one, v ) );
+		if ( m_tone_map == tm_aces ) {
+			__m128 n = _mm_mul_ps( v, _mm_add_ps( _mm_mul_ps( _mm_set1_ps( 2.51f ), v ), _mm_set1_ps( .03f ) ) );
+			__m128 d = _mm_add_ps( _mm_mul_ps( v, _mm_add_ps( _mm_mul_ps( _mm_set1_ps( 2.43f ), v ), _mm_set1_ps( .59f ) ) ), _mm_set1_ps( .14f ) );
+			v = _mm_div_ps( n, d );
+		}
+		return _mm_min_ps( v, one );
+	}
+#endif
+
+public:
+	hdr_resolve( float exposure = 1, tone_map tm = tm_clamp, bool srgb = false )
+		: m_exposure(exposure), m_tone_map(tm), m_srgb(srgb) {
+		for ( int i = 0; i < lut_size; i++ ) {
+			double v = (double)i / (lut_size - 1);
+			double s = v <= .0031308 ? v * 12.92 : 1.055 * pow( v, 1 / 2.4 ) - .055;
+			m_lut[i] = (uint8_t)(s * 255 + .5);
+		}
+	}
+
+	float exposure() const { return m_exposure; }
+	tone_map get_tone_map() const { return m_tone_map; }
+	bool srgb() const { return m_srgb; }
+
+	void set_exposure( float exposure ) { m_exposure = exposure; }
+	void set_tone_map( tone_map tm ) { m_tone_map = tm; }
+	void set_srgb( bool srgb ) { m_srgb = srgb; }
+
+	// n pixels of src to dst, weight - 1 / the samples summed up in src
+	void resolve( const float *src, uint32_t *dst, int n, float weight = 1 ) const {
+		float scale = m_exposure * weight;
+		int i = 0;
+#if defined( __SSE2__ )
+		const __m128 v_scale = _mm_set1_ps( scale );
+		const __m128i rgb = _mm_setr_epi32( -1, -1, -1, 0 );
+		for ( ; i + 4 <= n; i += 4 ) {
+			__m128 v[4];
+			for ( int k = 0; k < 4; k++ ) v[k] = map( _mm_loadu_ps( src + (i + k) * 4 ), v_scale );
+			if ( m_srgb ) {
+				const __m128 v_max = _mm_set1_ps( lut_size - 1 );
+				int32_t idx[16];
+				for ( int k = 0; k < 4; k++ ) {
+					_mm_storeu_si128( (__m128i *)(idx + k * 4), _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( v[k], v_max ), _mm_set1_ps( .5f ) ) ) );
+				}
+				for ( int k = 0; k < 4; k++ ) {
+					dst[i + k] = m_lut[idx[k * 4]] << 16 | m_lut[idx[k * 4 + 1]] << 8 | m_lut[idx[k * 4 + 2]];
+				}
+			} else {
+				// r, g, b, 0 lanes to b, g, r, 0 bytes
+				const __m128 v_255 = _mm_set1_ps( 255 );
+				__m128i c[4];
+				for ( int k = 0; k < 4; k++ ) {
+					c[k] = _mm_and_si128( _mm_cvttps_epi32( _mm_mul_ps( v[k], v_255 ) ), rgb );
+					c[k] = _mm_shuffle_epi32( c[k], _MM_SHUFFLE( 3, 0, 1, 2 ) );
+				}
+				__m128i p = _mm_packus_epi16( _mm_packs_epi32( c[0], c[1] ), _mm_packs_epi32( c[2], c[3] ) );
+				_mm_storeu_si128( (__m128i *)(dst + i), p );
+			}
+		}
+#endif
+		for ( ; i < n; i++ ) {
+			const float *p = src + i * 4;
+			dst[i] = encode( map( p[0], scale ) ) << 16 | encode( map( p[1], scale ) ) << 8 | encode( map( p[2], scale ) );
+		}
+	}
+};
+
+#endif // __HDR_RESOLVE_H__
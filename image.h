@@ -13,6 +13,11 @@
 #ifndef __IMAGE_H__
 #define __IMAGE_H__
 
+struct rect {
+	int	x0, y0;
+	int	x1, y1;
+};
+
 template <class T> class image {
 	T *		m_ptr;
 	int		m_width, m_height, m_stride;
@@ -12,15 +12,33 @@
 
 #include <windows.h>
 
+#include <atomic>
 #include <vector>
+#include <functional>
+#include <random>
+#include <algorithm>
 #include <cstdint>
+#include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
 #include <cfloat>
 #include <omp.h>
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
 
 #include "../image.h"
+#include "../fast_math.h"
 #include "../window.h"
+#include "../frame_sink.h"
+#include "../hdr_resolve.h"
+#include "../tile_farm.h"
+
+// rays leave surfaces only ~1e-9 ahead, so intersections and ray directions need every
+// bit of a double (a float-accurate sqrt puts the floor in its own shadow): geometry
+// stays exact whatever the fx_math tier, shading follows it
+typedef fast_math <math_exact> geo_math;
 
 #define	DEF_ABC_OP( op )																				\
 	abc & operator op##= ( const abc & z ) { a op##= z.a; b op##= z.b; c op##= z.c; return *this; }		\
@@ -38,6 +56,8 @@ public:
 
 	void set( T x, T y, T z ) { a = x; b = y; c = z; }
 
+	T operator [] ( int i ) const { return i == 0 ? a : (i == 1 ? b : c); }
+
 	DEF_ABC_OP( + )
 	DEF_ABC_OP( - )
 	DEF_ABC_OP( * )
@@ -68,7 +88,7 @@ public:
 	inline void normalize() {
 		T sl = sqr_length();
 		if ( sl > 0 ) {
-			T inv_len = 1. / sqrt( sl );
+			T inv_len = geo_math::rsqrt( sl );
 			a *= inv_len;
 			b *= inv_len;
 			c *= inv_len;
@@ -106,9 +126,12 @@ struct obj {
 	double	m_reflection;
 
 	obj( vec pos, rgb color, double reflection ) : m_pos(pos), m_rgb(color), m_reflection(reflection) {}
+	virtual ~obj() {}
 
-	virtual bool hit( const ray &, double *, double * ) { return false; }
-	virtual vec normal( vec & ) const { return vec( 0, 0, 0 ); }
+	// da, db - distances where the ray enters and leaves, part - the part of the object hit
+	// (a triangle of a mesh) for normal()
+	virtual bool hit( const ray &, double *, double *, unsigned * ) { return false; }
+	virtual vec normal( vec &, unsigned ) const { return vec( 0, 0, 0 ); }
 };
 
 class sphere : public obj {
@@ -118,7 +141,7 @@ class sphere : public obj {
 public:
 	sphere( vec pos, double r, rgb color, double reflection ) : obj( pos, color, reflection ), m_rad(r), m_sqr_rad( r * r ) {}
 
-	virtual bool hit( const ray & a_ray, double *da, double *db ) {
+	virtual bool hit( const ray & a_ray, double *da, double *db, unsigned * ) {
 		double ocs, ca, hc, hcs;
 		vec oc = m_pos - a_ray.m_pos;
 		ocs = oc.sqr_length();
@@ -126,7 +149,7 @@ public:
 		if ( (ocs >= m_sqr_rad) && (ca < DBL_EPSILON) ) return false;
 		hcs = m_sqr_rad - ocs + (ca * ca);
 		if ( hcs > DBL_EPSILON ) {
-			hc = sqrt( hcs );
+			hc = geo_math::sqrt( hcs );
 			*da = ca - hc;
 			*db = ca + hc;
 			return 1;
@@ -134,7 +157,499 @@ public:
 		return 0;
 	}
 
-	virtual vec normal( vec & isec ) const { return (isec - m_pos) / m_rad; }
+	virtual vec normal( vec & isec, unsigned ) const { return (isec - m_pos) / m_rad; }
+};
+
+//
+// infinite plane through m_pos, hit from either side
+//
+class plane : public obj {
+	vec		m_n;	// unit normal
+	double	m_d;	// m_n | m_pos
+
+public:
+	plane( vec pos, vec normal, rgb color, double reflection ) : obj( pos, color, reflection ), m_n(normal) {
+		m_n.normalize();
+		m_d = m_n | pos;
+	}
+
+	virtual bool hit( const ray & a_ray, double *da, double *db, unsigned * ) {
+		double t = (m_d - (m_n | a_ray.m_pos)) / (m_n | a_ray.m_dir);
+		*da = *db = t;
+		return t > DBL_EPSILON && t < DBL_MAX; // a parallel ray gives inf or nan
+	}
+
+	virtual vec normal( vec &, unsigned ) const { return m_n; }
+};
+
+//
+// indexed triangle mesh: the triangles share one vertex buffer, kept as floats or quantized to
+// 16 bits over the mesh bounds (6 bytes a vertex instead of 12), under a bounding volume
+// hierarchy whose nodes keep the boxes of both children (60 bytes, both boxes tested at
+// once) and up to leaf_size triangles a leaf. Triangles are tested with the watertight
+// algorithm of Woop, Benthin and Wald (a ray through a shared edge or vertex hits one of its
+// triangles, never none), two at a time with SSE2. Faces are flat, (v1 - v0) x (v2 - v0) is
+// the outer side.
+//
+class mesh : public obj {
+	struct node {
+		float		m_box[6][2];	// lo x, y, z and hi x, y, z of both children, rounded outwards
+		uint32_t	m_child[2];		// node, or first triangle of a leaf (0 with no triangles - no child)
+		uint16_t	m_count[2];		// leaf triangles, 0 - inner node
+	};
+
+	// ray constants: the axes permuted so that the ray runs along the last one, and the shear
+	// taking it to (0, 0, 1)
+	struct tri_ray {
+		int		m_k[3];
+		double	m_s[3];
+		double	m_org[3];
+		double	m_inv[3];	// 1 / direction, for the boxes
+
+		tri_ray( const ray & a_ray ) {
+			double d[3];
+			for ( int k = 0; k < 3; k++ ) {
+				d[k] = a_ray.m_dir[k];
+				m_org[k] = a_ray.m_pos[k];
+				m_inv[k] = 1 / d[k];
+			}
+			int kz = fabs( d[0] ) > fabs( d[1] ) ? (fabs( d[0] ) > fabs( d[2] ) ? 0 : 2) : (fabs( d[1] ) > fabs( d[2] ) ? 1 : 2);
+			int kx = kz == 2 ? 0 : kz + 1;
+			int ky = kx == 2 ? 0 : kx + 1;
+			if ( d[kz] < 0 ) std::swap( kx, ky );	// keeps the winding
+			m_k[0] = kx;
+			m_k[1] = ky;
+			m_k[2] = kz;
+			m_s[0] = d[kx] / d[kz];
+			m_s[1] = d[ky] / d[kz];
+			m_s[2] = 1 / d[kz];
+		}
+
+		// both child boxes of nd within t_max: bit c set for child c, entry distances to t_near;
+		// a ray lying in the plane of a box face misses the box: its 0 * inf slab limit is a nan,
+		// min/max (and the ternaries below) take the other limit, +-inf, which empties the range;
+		// it could only graze the face, where the triangle test finds nothing either
+		int boxes( const node & nd, double t_max, double t_near[2] ) const {
+#if defined( __SSE2__ )
+			__m128d t0 = _mm_setzero_pd(), t1 = _mm_set1_pd( t_max );
+			for ( int k = 0; k < 3; k++ ) {
+				__m128d o   = _mm_set1_pd( m_org[k] );
+				__m128d inv = _mm_set1_pd( m_inv[k] );
+				__m128d a = _mm_mul_pd( _mm_sub_pd( _mm_cvtps_pd( _mm_castsi128_ps( _mm_loadl_epi64( (const __m128i *)nd.m_box[k] ) ) ), o ), inv );
+				__m128d b = _mm_mul_pd( _mm_sub_pd( _mm_cvtps_pd( _mm_castsi128_ps( _mm_loadl_epi64( (const __m128i *)nd.m_box[k + 3] ) ) ), o ), inv );
+				t0 = _mm_max_pd( _mm_min_pd( a, b ), t0 );
+				t1 = _mm_min_pd( _mm_max_pd( a, b ), t1 );
+			}
+			_mm_storeu_pd( t_near, t0 );
+			return _mm_movemask_pd( _mm_cmple_pd( t0, t1 ) );
+#else
+			int mask = 0;
+			for ( int c = 0; c < 2; c++ ) {
+				double t0 = 0, t1 = t_max;
+				for ( int k = 0; k < 3; k++ ) {
+					double a = (nd.m_box[k][c] - m_org[k]) * m_inv[k];
+					double b = (nd.m_box[k + 3][c] - m_org[k]) * m_inv[k];
+					double lo = a < b ? a : b, hi = a > b ? a : b;
+					t0 = lo > t0 ? lo : t0;
+					t1 = hi < t1 ? hi : t1;
+				}
+				t_near[c] = t0;
+				if ( t0 <= t1 ) mask |= 1 << c;
+			}
+			return mask;
+#endif
+		}
+	};
+
+	enum { leaf_size = 4 };
+
+	std::vector <float>		m_fv;		// x, y, z a vertex, unless quantized
+	std::vector <uint16_t>	m_qv;		// quantized x, y, z a vertex
+	double					m_q0[3], m_qs[3];	// vertex = m_q0 + q * m_qs
+	std::vector <uint32_t>	m_tris;		// 3 vertices a triangle, in leaf order
+	std::vector <node>		m_nodes;	// depth first, the root is the first one
+
+	void vertex( uint32_t i, double v[3] ) const {
+		if ( m_qv.empty() ) {
+			const float *f = &m_fv[i * 3];
+			for ( int k = 0; k < 3; k++ ) v[k] = f[k];
+		} else {
+			const uint16_t *q = &m_qv[i * 3];
+			for ( int k = 0; k < 3; k++ ) v[k] = m_q0[k] + q[k] * m_qs[k];
+		}
+	}
+
+	vec vertex( uint32_t i ) const {
+		double v[3];
+		vertex( i, v );
+		return vec( v[0], v[1], v[2] );
+	}
+
+	// corners of triangle t relative to the ray origin, sheared: the ray is the z axis
+	void corners( unsigned t, const tri_ray & r, double x[3], double y[3], double z[3] ) const {
+		for ( int j = 0; j < 3; j++ ) {
+			double v[3];
+			vertex( m_tris[t * 3 + j], v );
+			for ( int k = 0; k < 3; k++ ) v[k] -= r.m_org[k];
+			x[j] = v[r.m_k[0]] - r.m_s[0] * v[r.m_k[2]];
+			y[j] = v[r.m_k[1]] - r.m_s[1] * v[r.m_k[2]];
+			z[j] = r.m_s[2] * v[r.m_k[2]];
+		}
+	}
+
+	// triangles [t, end) of a leaf, a closer hit goes to *dist and *part
+	void hit_leaf( unsigned t, unsigned end, const tri_ray & r, double *dist, unsigned *part ) const {
+#if defined( __SSE2__ )
+		const __m128d v_zero = _mm_setzero_pd();
+		const __m128d v_eps  = _mm_set1_pd( DBL_EPSILON );
+		for ( ; t + 2 <= end; t += 2 ) {
+			double ax[3], ay[3], az[3], bx[3], by[3], bz[3];
+			corners( t, r, ax, ay, az );
+			corners( t + 1, r, bx, by, bz );
+			__m128d x[3], y[3], z[3];
+			for ( int j = 0; j < 3; j++ ) {
+				x[j] = _mm_setr_pd( ax[j], bx[j] );
+				y[j] = _mm_setr_pd( ay[j], by[j] );
+				z[j] = _mm_setr_pd( az[j], bz[j] );
+			}
+			// edge functions, all of one sign inside
+			__m128d u = _mm_sub_pd( _mm_mul_pd( x[2], y[1] ), _mm_mul_pd( y[2], x[1] ) );
+			__m128d v = _mm_sub_pd( _mm_mul_pd( x[0], y[2] ), _mm_mul_pd( y[0], x[2] ) );
+			__m128d w = _mm_sub_pd( _mm_mul_pd( x[1], y[0] ), _mm_mul_pd( y[1], x[0] ) );
+			__m128d neg = _mm_or_pd( _mm_or_pd( _mm_cmplt_pd( u, v_zero ), _mm_cmplt_pd( v, v_zero ) ), _mm_cmplt_pd( w, v_zero ) );
+			__m128d pos = _mm_or_pd( _mm_or_pd( _mm_cmpgt_pd( u, v_zero ), _mm_cmpgt_pd( v, v_zero ) ), _mm_cmpgt_pd( w, v_zero ) );
+			__m128d det = _mm_add_pd( _mm_add_pd( u, v ), w );
+			__m128d d = _mm_div_pd( _mm_add_pd( _mm_add_pd( _mm_mul_pd( u, z[0] ), _mm_mul_pd( v, z[1] ) ), _mm_mul_pd( w, z[2] ) ), det );
+			__m128d ok = _mm_andnot_pd( _mm_and_pd( neg, pos ), _mm_and_pd( _mm_cmpgt_pd( d, v_eps ), _mm_cmplt_pd( d, _mm_set1_pd( *dist ) ) ) );
+			int mask = _mm_movemask_pd( ok );
+			if ( mask ) {
+				double dd[2];
+				_mm_storeu_pd( dd, d );
+				for ( int i = 0; i < 2; i++ ) {
+					if ( (mask >> i & 1) && dd[i] < *dist ) {
+						*dist = dd[i];
+						*part = t + i;
+					}
+				}
+			}
+		}
+#endif
+		for ( ; t < end; t++ ) {
+			double x[3], y[3], z[3];
+			corners( t, r, x, y, z );
+			double u = x[2] * y[1] - y[2] * x[1];
+			double v = x[0] * y[2] - y[0] * x[2];
+			double w = x[1] * y[0] - y[1] * x[0];
+			if ( (u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0) ) continue;
+			double d = (u * z[0] + v * z[1] + w * z[2]) / (u + v + w);	// det 0 gives inf or nan
+			if ( d > DBL_EPSILON && d < *dist ) {
+				*dist = d;
+				*part = t;
+			}
+		}
+	}
+
+	// median split of order[begin, end) along the longest extent of the triangle centers
+	static unsigned split( std::vector <unsigned> & order, unsigned begin, unsigned end, const std::vector <vec> & centers ) {
+		double lo[3] = {  DBL_MAX,  DBL_MAX,  DBL_MAX };
+		double hi[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+		for ( unsigned i = begin; i < end; i++ ) {
+			for ( int k = 0; k < 3; k++ ) {
+				lo[k] = std::min( lo[k], centers[order[i]][k] );
+				hi[k] = std::max( hi[k], centers[order[i]][k] );
+			}
+		}
+		int axis = 0;
+		for ( int k = 1; k < 3; k++ ) {
+			if ( hi[k] - lo[k] > hi[axis] - lo[axis] ) axis = k;
+		}
+		unsigned mid = (begin + end) / 2;
+		std::nth_element( order.begin() + begin, order.begin() + mid, order.begin() + end,
+			[&]( unsigned a, unsigned b ) { return centers[a][axis] < centers[b][axis]; } );
+		return mid;
+	}
+
+	// subtree over order[begin, end) as child c of node at
+	void build( std::vector <unsigned> & order, unsigned begin, unsigned end, const std::vector <uint32_t> & tris, const std::vector <vec> & centers, unsigned at, int c ) {
+		m_nodes[at].m_child[c] = 0;
+		m_nodes[at].m_count[c] = 0;
+		if ( begin == end ) return;
+
+		double lo[3] = {  DBL_MAX,  DBL_MAX,  DBL_MAX };
+		double hi[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+		for ( unsigned i = begin; i < end; i++ ) {
+			for ( int j = 0; j < 3; j++ ) {
+				double v[3];
+				vertex( tris[order[i] * 3 + j], v );
+				for ( int k = 0; k < 3; k++ ) {
+					lo[k] = std::min( lo[k], v[k] );
+					hi[k] = std::max( hi[k], v[k] );
+				}
+			}
+		}
+		for ( int k = 0; k < 3; k++ ) {
+			float l = lo[k], h = hi[k];
+			m_nodes[at].m_box[k][c]     = l > lo[k] ? nextafterf( l, -FLT_MAX ) : l;
+			m_nodes[at].m_box[k + 3][c] = h < hi[k] ? nextafterf( h,  FLT_MAX ) : h;
+		}
+
+		if ( end - begin <= leaf_size ) {
+			m_nodes[at].m_child[c] = m_tris.size() / 3;
+			m_nodes[at].m_count[c] = end - begin;
+			for ( unsigned i = begin; i < end; i++ ) {
+				m_tris.insert( m_tris.end(), &tris[order[i] * 3], &tris[order[i] * 3] + 3 );
+			}
+			return;
+		}
+
+		unsigned n = m_nodes.size();
+		m_nodes.push_back( node() );
+		m_nodes[at].m_child[c] = n;
+		unsigned mid = split( order, begin, end, centers );
+		build( order, begin, mid, tris, centers, n, 0 );
+		build( order, mid, end, tris, centers, n, 1 );
+	}
+
+public:
+	// tris - 3 indices into verts a triangle; quantize - keep the vertices in 16 bits
+	mesh( const std::vector <vec> & verts, const std::vector <uint32_t> & tris, rgb color, double reflection, bool quantize )
+		: obj( vec( 0, 0, 0 ), color, reflection ) {
+		double lo[3] = {  DBL_MAX,  DBL_MAX,  DBL_MAX };
+		double hi[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+		for ( auto & v : verts ) {
+			for ( int k = 0; k < 3; k++ ) {
+				lo[k] = std::min( lo[k], v[k] );
+				hi[k] = std::max( hi[k], v[k] );
+			}
+		}
+		if ( verts.empty() || tris.empty() ) return;
+		m_pos.set( (lo[0] + hi[0]) * .5, (lo[1] + hi[1]) * .5, (lo[2] + hi[2]) * .5 );
+
+		if ( quantize ) {
+			for ( int k = 0; k < 3; k++ ) {
+				m_q0[k] = lo[k];
+				m_qs[k] = (hi[k] - lo[k]) / 65535;
+			}
+			m_qv.resize( verts.size() * 3 );
+			for ( size_t i = 0; i < verts.size(); i++ ) {
+				for ( int k = 0; k < 3; k++ ) {
+					m_qv[i * 3 + k] = m_qs[k] > 0 ? (uint16_t)floor( (verts[i][k] - lo[k]) / m_qs[k] + .5 ) : 0;
+				}
+			}
+		} else {
+			m_fv.resize( verts.size() * 3 );
+			for ( size_t i = 0; i < verts.size(); i++ ) {
+				for ( int k = 0; k < 3; k++ ) m_fv[i * 3 + k] = verts[i][k];
+			}
+		}
+
+		unsigned n = tris.size() / 3;
+		std::vector <unsigned> order( n );
+		std::vector <vec> centers( n );
+		for ( unsigned i = 0; i < n; i++ ) {
+			order[i] = i;
+			centers[i] = (vertex( tris[i * 3] ) + vertex( tris[i * 3 + 1] ) + vertex( tris[i * 3 + 2] )) / 3;
+		}
+		m_tris.reserve( n * 3 );
+		m_nodes.push_back( node() );	// the root, never anyone's child
+		unsigned mid = split( order, 0, n, centers );
+		build( order, 0, mid, tris, centers, 0, 0 );
+		build( order, mid, n, tris, centers, 0, 1 );
+	}
+
+	virtual bool hit( const ray & a_ray, double *da, double *db, unsigned *part ) {
+		if ( m_nodes.empty() ) return false;
+		tri_ray r( a_ray );
+		double dist = DBL_MAX;
+		unsigned stack[64], sp = 0, n = 0;
+		double stack_t[64];	// entry distances of the stacked nodes
+		for ( ;; ) {
+			const node & nd = m_nodes[n];
+			double t[2];
+			int mask = r.boxes( nd, dist, t );
+			int next[2], count = 0;
+			for ( int c = 0; c < 2; c++ ) {
+				if ( !(mask >> c & 1) ) continue;
+				if ( nd.m_count[c] ) {
+					hit_leaf( nd.m_child[c], nd.m_child[c] + nd.m_count[c], r, &dist, part );
+				} else if ( nd.m_child[c] ) {
+					next[count++] = c;
+				}
+			}
+			if ( count == 2 ) {
+				// the nearer child first
+				int c = t[1] < t[0];
+				stack[sp] = nd.m_child[!c];
+				stack_t[sp++] = t[!c];
+				n = nd.m_child[c];
+			} else if ( count == 1 ) {
+				n = nd.m_child[next[0]];
+			} else {
+				while ( sp && stack_t[sp - 1] > dist ) sp--;
+				if ( !sp ) break;
+				n = stack[--sp];
+			}
+		}
+		if ( dist == DBL_MAX ) return false;
+		*da = *db = dist;
+		return true;
+	}
+
+	virtual vec normal( vec &, unsigned part ) const {
+		vec v0 = vertex( m_tris[part * 3] );
+		vec n = (vertex( m_tris[part * 3 + 1] ) - v0).cross( vertex( m_tris[part * 3 + 2] ) - v0 );
+		n.normalize();
+		return n;
+	}
+};
+
+// torus around the z axis tilted about x by tilt radians, seg x ring quads
+static mesh * make_torus( vec pos, double r_major, double r_minor, unsigned seg, unsigned ring, double tilt, rgb color, double reflection, bool quantize ) {
+	std::vector <vec> verts;
+	std::vector <uint32_t> tris;
+	double ct = cos( tilt ), st = sin( tilt );
+	for ( unsigned i = 0; i < seg; i++ )
+	for ( unsigned j = 0; j < ring; j++ ) {
+		double u = 6.28318530717958648 * i / seg, v = 6.28318530717958648 * j / ring;
+		double x = (r_major + r_minor * cos( v )) * cos( u );
+		double y = (r_major + r_minor * cos( v )) * sin( u );
+		double z = r_minor * sin( v );
+		verts.push_back( pos + vec( x, y * ct - z * st, y * st + z * ct ) );
+
+		uint32_t p00 = i * ring + j, p10 = (i + 1) % seg * ring + j;
+		uint32_t p01 = i * ring + (j + 1) % ring, p11 = (i + 1) % seg * ring + (j + 1) % ring;
+		uint32_t quad[] = { p00, p10, p11, p00, p11, p01 };
+		tris.insert( tris.end(), quad, quad + 6 );
+	}
+	return new mesh( verts, tris, color, reflection, quantize );
+}
+
+
+
+//
+// lights: distant ones (m_range == 0) light everything with no falloff, local ones fall off
+// with the inverse square of the distance, windowed to reach exactly zero at m_range, the
+// distance where the contribution drops below the scene's light threshold
+//
+struct light {
+	vec		m_pos;
+	rgb		m_rgb;
+	double	m_intensity;
+	double	m_range;
+
+	light( vec pos, rgb color ) : m_pos(pos), m_rgb(color), m_intensity(1), m_range(0) {}
+	light( vec pos, rgb color, double intensity, double threshold )
+		: m_pos(pos), m_rgb(color), m_intensity(intensity), m_range( sqrt( intensity / threshold ) ) {}
+
+	double attenuation( double sqr_dist ) const {
+		if ( m_range == 0 ) return 1;
+		double w = 1 - sqr_dist / (m_range * m_range);
+		if ( w <= 0 ) return 0;
+		return m_intensity / (sqr_dist + 1) * w * w;
+	}
+};
+
+//
+// uniform grid over local lights, every cell lists the lights whose range reaches it;
+// distant lights reach everything and are listed apart
+//
+class light_grid {
+	vec						m_min;
+	double					m_cell;
+	int						m_n[3];
+	std::vector <unsigned>	m_first;	// per cell, m_first[c] .. m_first[c + 1] in m_index
+	std::vector <unsigned>	m_index;
+	std::vector <unsigned>	m_distant;
+
+	int cell( double v, double lo, int n ) const {
+		int i = (int)floor( (v - lo) / m_cell );
+		return i < 0 ? 0 : (i >= n ? n - 1 : i);
+	}
+
+public:
+	light_grid() : m_min( 0, 0, 0 ), m_cell(1) { m_n[0] = m_n[1] = m_n[2] = 0; }
+
+	void build( const std::vector <light> & lights ) {
+		double lo[3] = {  DBL_MAX,  DBL_MAX,  DBL_MAX };
+		double hi[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+		std::vector <unsigned> local;
+		m_distant.clear();
+		for ( unsigned i = 0; i < lights.size(); i++ ) {
+			const light & l = lights[i];
+			if ( l.m_range == 0 ) {
+				m_distant.push_back( i );
+				continue;
+			}
+			local.push_back( i );
+			for ( int k = 0; k < 3; k++ ) {
+				if ( l.m_pos[k] - l.m_range < lo[k] ) lo[k] = l.m_pos[k] - l.m_range;
+				if ( l.m_pos[k] + l.m_range > hi[k] ) hi[k] = l.m_pos[k] + l.m_range;
+			}
+		}
+		m_n[0] = m_n[1] = m_n[2] = 0;
+		m_first.clear();
+		m_index.clear();
+		if ( local.empty() ) return;
+
+		// about two cells per light along the longest axis of a cubic grid
+		double ext = std::max( hi[0] - lo[0], std::max( hi[1] - lo[1], hi[2] - lo[2] ) );
+		int res = std::min( 64, std::max( 1, (int)(2 * cbrt( (double)local.size() ) ) ) );
+		m_cell = ext / res;
+		m_min.set( lo[0], lo[1], lo[2] );
+		for ( int k = 0; k < 3; k++ ) {
+			m_n[k] = std::max( 1, (int)ceil( (hi[k] - lo[k]) / m_cell ) );
+		}
+
+		// two passes: count, then fill
+		std::vector <unsigned> count( m_n[0] * m_n[1] * m_n[2] + 1, 0 );
+		for ( int pass = 0; pass < 2; pass++ ) {
+			for ( unsigned i : local ) {
+				const light & l = lights[i];
+				const vec & p = l.m_pos;
+				int c0[3], c1[3];
+				for ( int k = 0; k < 3; k++ ) {
+					c0[k] = cell( p[k] - l.m_range, lo[k], m_n[k] );
+					c1[k] = cell( p[k] + l.m_range, lo[k], m_n[k] );
+				}
+				for ( int z = c0[2]; z <= c1[2]; z++ )
+				for ( int y = c0[1]; y <= c1[1]; y++ )
+				for ( int x = c0[0]; x <= c1[0]; x++ ) {
+					// sphere vs cell box
+					double d2 = 0, c[3] = { (double)x, (double)y, (double)z };
+					for ( int k = 0; k < 3; k++ ) {
+						double b0 = lo[k] + c[k] * m_cell, b1 = b0 + m_cell;
+						double q = p[k] < b0 ? b0 - p[k] : (p[k] > b1 ? p[k] - b1 : 0);
+						d2 += q * q;
+					}
+					if ( d2 > l.m_range * l.m_range ) continue;
+					unsigned ci = (z * m_n[1] + y) * m_n[0] + x;
+					if ( pass == 0 ) count[ci + 1]++; else m_index[count[ci]++] = i;
+				}
+			}
+			if ( pass == 0 ) {
+				for ( size_t c = 1; c < count.size(); c++ ) count[c] += count[c - 1];
+				m_first = count;
+				m_index.resize( count.back() );
+			}
+		}
+	}
+
+	const std::vector <unsigned> & distant() const { return m_distant; }
+
+	// local lights which may reach point p
+	void query( const vec & p, const unsigned **begin, const unsigned **end ) const {
+		*begin = *end = 0;
+		if ( !m_n[0] ) return;
+		int c[3];
+		for ( int k = 0; k < 3; k++ ) {
+			double f = (p[k] - m_min[k]) / m_cell;
+			if ( f < 0 || f >= m_n[k] ) return;
+			c[k] = (int)f;
+		}
+		unsigned ci = (c[2] * m_n[1] + c[1]) * m_n[0] + c[0];
+		*begin = &m_index[0] + m_first[ci];
+		*end   = &m_index[0] + m_first[ci + 1];
+	}
 };
 
 
@@ -147,19 +662,30 @@ enum {
 	max_reflection_recursion = 5
 };
 
-class the_ray_tracer : public window {
+static const double light_threshold = 1. / 512; // local lights are cut off below half of an 8-bit step
+static const double shadow_bias = 1e-6;			// shadow ray hits closer than that are the surface itself
+static const int farm_tile = 32;				// pixels, the side of a tile farm job
 
-//	std::vector <light *>	m_lights;
+//
+// scene and tracing, no window attached, so tile farm workers can use it
+//
+class ray_tracer {
+
+	std::vector <light>		m_lights;
+	light_grid				m_light_grid;
+	unsigned				m_light_samples;	// 0 - shade every local light in reach
 	std::vector <obj *>		m_objs;
 
-	obj * hit_any( const ray & a_ray, double *closest ) {
+	obj * hit_any( const ray & a_ray, double *closest, unsigned *part ) {
 		obj * p_obj = 0;
 		*closest = DBL_MAX;
 		for ( auto & p : m_objs ) {
 			double da, db;
-			if ( p->hit( a_ray, &da, &db ) ) {
+			unsigned pt = 0;
+			if ( p->hit( a_ray, &da, &db, &pt ) ) {
 				if ( da < *closest ) {
 					*closest = da;
+					*part = pt;
 					p_obj = p;
 				}
 			}
@@ -167,49 +693,124 @@ class the_ray_tracer : public window {
 		return p_obj;
 	}
 
-	rgb trace( const vec & a_eye, ray & a_ray, unsigned recursion ) {
-		rgb	color( 0, 0, 0 );
-		if ( recursion ) {
-			double	closest;
-			obj *p_obj = hit_any( a_ray, &closest );
-			if ( p_obj ) {
+	// anything crossing a_ray between shadow_bias and max_t, entering or leaving; a ray
+	// starting inside the object it was shot from (rounding) sees only its far side
+	bool occluded( const ray & a_ray, double max_t ) {
+		for ( auto & p : m_objs ) {
+			double da, db;
+			unsigned pt = 0;
+			if ( p->hit( a_ray, &da, &db, &pt ) ) {
+				if ( (da > shadow_bias && da < max_t) || (db > shadow_bias && db < max_t) ) return true;
+			}
+		}
+		return false;
+	}
 
-				vec isec = a_ray[closest];			// get intersection point
-				vec norm = p_obj->normal( isec );	// get normal
+	// light l at isec, shadow included
+	rgb shade( const light & l, const obj *p_obj, const vec & isec, const vec & norm, const vec & a_eye ) {
+		vec light_dir = l.m_pos - isec;
+		double sqr_dist = light_dir.sqr_length();
+		double att = l.attenuation( sqr_dist );
+		if ( att <= 0 ) return rgb( 0, 0, 0 );
 
-				vec lights[] = {
-					{ -1000,  100, -100 },
-					{  1000, -500, -100 } };
+		ray	s_ray( isec, light_dir ); // shadow ray
+		s_ray.m_dir.normalize();
+		s_ray.m_pos = s_ray[DBL_EPSILON + .000000001]; // shoft a little forward
 
-				for ( size_t i = 0; i < 2; i++ ) {
-					vec light_dir = lights[i] - isec;
+		if ( l.m_range == 0 ) {
+			double tmp;
+			unsigned part;
+			if ( hit_any( s_ray, &tmp, &part ) ) return rgb( 0, 0, 0 );
+		} else if ( occluded( s_ray, sqrt( sqr_dist ) ) ) {
+			return rgb( 0, 0, 0 ); // a local light is only hidden by something in between
+		}
+		light_dir.normalize();
 
-					ray	s_ray( isec, light_dir ); // shadow ray
-					s_ray.m_dir.normalize();
-					s_ray.m_pos = s_ray[DBL_EPSILON + .000000001]; // shoft a little forward
+		double dot = light_dir | norm;
+		if ( dot < 0 ) dot = 0;
 
-					double tmp;
-					if ( !hit_any( s_ray, &tmp ) ) {
-						light_dir.normalize();
+		vec i2e = isec - a_eye; // intersection to eye direction
+		i2e.normalize();
+		//vec spec = ; // specular vector
+		double s_dot = light_dir | (i2e ^ norm);
+		if ( s_dot < 0 ) s_dot = 0;
 
-						double dot = light_dir | norm;
-						if ( dot < 0 ) dot = 0;
+		return (p_obj->m_rgb * dot + /* specular color */rgb( 1, 1, 1 ) * fx_math::ipow <12>( s_dot )) * l.m_rgb * att;
+	}
 
-						vec i2e = isec - a_eye; // intersection to eye direction
-						i2e.normalize();
-						//vec spec = ; // specular vector
-						double s_dot = light_dir | (i2e ^ norm);
-						if ( s_dot < 0 ) s_dot = 0;
+	// expected unshadowed contribution, for picking lights by importance
+	static double importance( const light & l, const vec & isec, const vec & norm ) {
+		vec light_dir = l.m_pos - isec;
+		double sqr_dist = light_dir.sqr_length();
+		double dot = (light_dir | norm) / fx_math::sqrt( sqr_dist );
+		if ( dot < 0 ) dot = 0;
+		return l.attenuation( sqr_dist ) * (dot + .05) * (l.m_rgb | rgb( .3, .59, .11 ));
+	}
 
-						color += p_obj->m_rgb * dot + /* specular color */rgb( 1, 1, 1 ) * pow( s_dot, 12 );
-					}
+	static double rnd( uint32_t & seed ) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed * (1. / 4294967296.);
+	}
+
+	// local lights reaching isec: all of them, or m_light_samples picked by importance
+	// (stratified over the summed importance) and weighted by 1 / probability
+	rgb shade_local( const obj *p_obj, const vec & isec, const vec & norm, const vec & a_eye, uint32_t & seed ) {
+		rgb color( 0, 0, 0 );
+		const unsigned *begin, *end;
+		m_light_grid.query( isec, &begin, &end );
+		if ( !m_light_samples || (unsigned)(end - begin) <= m_light_samples ) {
+			for ( const unsigned *i = begin; i < end; i++ ) {
+				color += shade( m_lights[*i], p_obj, isec, norm, a_eye );
+			}
+			return color;
+		}
+
+		double weights[256];	// kept for the second pass if there aren't too many
+		bool cached = end - begin <= 256;
+		double total = 0;
+		for ( const unsigned *i = begin; i < end; i++ ) {
+			double w = importance( m_lights[*i], isec, norm );
+			if ( cached ) weights[i - begin] = w;
+			total += w;
+		}
+		if ( total <= 0 ) return color;
+
+		double step = total / m_light_samples;
+		double next = rnd( seed ) * step;	// next stratum point
+		double cum = 0;
+		for ( const unsigned *i = begin; i < end && next < total; i++ ) {
+			double w = cached ? weights[i - begin] : importance( m_lights[*i], isec, norm );
+			cum += w;
+			unsigned n = 0;
+			for ( ; next < cum; next += step ) n++;
+			if ( n ) color += shade( m_lights[*i], p_obj, isec, norm, a_eye ) * (n * step / w);
+		}
+		return color;
+	}
+
+	rgb trace( const vec & a_eye, ray & a_ray, unsigned recursion, uint32_t & seed ) {
+		rgb	color( 0, 0, 0 );
+		if ( recursion ) {
+			double	closest;
+			unsigned part;
+			obj *p_obj = hit_any( a_ray, &closest, &part );
+			if ( p_obj ) {
+
+				vec isec = a_ray[closest];				// get intersection point
+				vec norm = p_obj->normal( isec, part );	// get normal
+
+				for ( unsigned i : m_light_grid.distant() ) {
+					color += shade( m_lights[i], p_obj, isec, norm, a_eye );
 				}
+				color += shade_local( p_obj, isec, norm, a_eye, seed );
 
 				if ( p_obj->m_reflection > 0 ) {
 					ray r_ray( isec, a_ray.m_dir ^ norm );
 					r_ray.m_dir.normalize();
 					r_ray.m_pos = r_ray[DBL_EPSILON + .000000001]; // shoft a little forward
-					rgb r_rgb = trace( a_eye, r_ray, recursion - 1 );
+					rgb r_rgb = trace( a_eye, r_ray, recursion - 1, seed );
 					color.blend( r_rgb, 1 - p_obj->m_reflection );
 				}
 			}
@@ -218,46 +819,298 @@ class the_ray_tracer : public window {
 	}
 
 public:
-	the_ray_tracer( int x, int y, int w, int h ) : window( x, y, w, h, 1 ) {}
-	virtual ~the_ray_tracer() {}
-
-	void on_create() {
+	ray_tracer() : m_light_samples(0) {}
+	~ray_tracer() {
+		for ( auto & p : m_objs ) delete p;
+	}
 
-		// create scene
+	// samples > 0 shades only that many local lights per hit, chosen by importance;
+	// with_mesh adds a triangle mesh (a torus, 2304 triangles quantized to 16 bits)
+	void create_scene( unsigned extra_lights, unsigned light_samples, bool with_mesh ) {
 		m_objs.push_back( new sphere( {  100,  50,   150 },   100, { .8,  1,  1 }, .5 ) );
 		m_objs.push_back( new sphere( { -150, -50,   160 },    80, {  0,  0,  0 }, .8 ) );
 		m_objs.push_back( new sphere( { -100, 100,   180 },    40, {  1, .7, .7 }, .2 ) );
-		m_objs.push_back( new sphere( {    0,   0, 10000 },  9800, { .5, .5, .5 },  0 ) );
-
-		// render scene
-		#pragma omp parallel for
-		for ( int y = 0; y < m_h; y++ ) {
-			for ( int x = 0; x < m_w; x++ ) {
-				rgb accum( 0, 0, 0 );
-				for ( double sy = y - .5; sy < y + .5; sy += 1. / ss_size )
-				for ( double sx = x - .5; sx < x + .5; sx += 1. / ss_size ) {
-					vec a_eye(
-						 (sx - (m_w - 1) * .5),
-						-(sy - (m_h - 1) * .5), 0 );
-					ray a_ray( a_eye, vec( 0, 0, 1 ) );
-					accum += trace( a_eye, a_ray, max_reflection_recursion );
+		m_objs.push_back( new plane( { 0, 0, 200 }, { 0, 0, -1 }, { .5, .5, .5 }, 0 ) );
+		if ( with_mesh ) m_objs.push_back( make_torus( { 250, -160, 150 }, 70, 25, 48, 24, 1, { 1, .85, .4 }, .3, true ) );
+
+		m_lights.push_back( light( { -1000,  100, -100 }, { 1, 1, 1 } ) );
+		m_lights.push_back( light( {  1000, -500, -100 }, { 1, 1, 1 } ) );
+
+		std::mt19937 gen( 1 );
+		std::uniform_real_distribution <double> u( 0, 1 );
+		for ( unsigned i = 0; i < extra_lights; i++ ) {
+			vec pos( u( gen ) * 800 - 400, u( gen ) * 600 - 300, u( gen ) * 90 + 100 );
+			rgb color( u( gen ) * .8 + .2, u( gen ) * .8 + .2, u( gen ) * .8 + .2 );
+			m_lights.push_back( light( pos, color, u( gen ) * 50 + 10, light_threshold ) );
+		}
+		m_light_grid.build( m_lights );
+		m_light_samples = light_samples;
+	}
+
+	// pixels [x0, x1) x [y0, y1) of a w x h frame with all passes to dst (4 floats a pixel,
+	// pitch in floats), the same for a worker and here
+	void render_rect( int x0, int y0, int x1, int y1, int w, int h, unsigned passes, float * dst, size_t pitch ) {
+		for ( int y = y0; y < y1; y++ ) {
+			float *p = dst + (y - y0) * pitch;
+			for ( int x = x0; x < x1; x++, p += 4 ) {
+				p[0] = p[1] = p[2] = p[3] = 0;
+				for ( unsigned pass = 0; pass < passes; pass++ ) {
+					add_pixel( x, y, w, h, pass, p );
 				}
-				accum /= ss_size_sqr;
-				m_ptr[m_w * y + x] = accum.rgb32();
 			}
+		}
+	}
 
-			if ( omp_get_thread_num() == 0 ) {
-				if ( y % 5 == 0 )
-					update();
-			}
+	// super-sampled pixel (x, y) of a w x h frame added to acc (linear r, g, b); every pass
+	// shifts the sample grid (R2 sequence) and the light sampling, so passes add up
+	void add_pixel( int x, int y, int w, int h, unsigned pass, float * acc ) {
+		rgb accum( 0, 0, 0 );
+		uint32_t seed = ((y * w + x) * 2654435761u ^ pass * 0x9e3779b9u) | 1;
+		double ox = pass * .7548776662466927, oy = pass * .5698402909980532;
+		ox = (ox - floor( ox )) / ss_size;
+		oy = (oy - floor( oy )) / ss_size;
+		for ( int i = 0; i < ss_size; i++ )
+		for ( int j = 0; j < ss_size; j++ ) {
+			double sx = x - .5 + ox + j * (1. / ss_size);
+			double sy = y - .5 + oy + i * (1. / ss_size);
+			vec a_eye(
+				 (sx - (w - 1) * .5),
+				-(sy - (h - 1) * .5), 0 );
+			ray a_ray( a_eye, vec( 0, 0, 1 ) );
+			accum += trace( a_eye, a_ray, max_reflection_recursion, seed );
+		}
+		accum /= ss_size_sqr;
+		acc[0] += accum[0];
+		acc[1] += accum[1];
+		acc[2] += accum[2];
+	}
+};
+
+class the_ray_tracer : public window {
+	ray_tracer		m_tracer;
+	unsigned		m_extra_lights;		// local lights scattered over the scene
+	unsigned		m_light_samples;
+	bool			m_mesh;				// the scene has a triangle mesh
+	unsigned		m_passes;			// rendered one after another, summed up in m_hdr
+	std::vector <float>	m_hdr;			// linear r, g, b, 0 a pixel
+	hdr_resolve		m_resolve;
+	unsigned		m_procs;			// worker processes, 0 - render with OpenMP here
+	const char *	m_worker_cmd;		// command line starting a worker
+	frame_sink *	m_sink;				// offline rendering, NULL - on screen only
+
+	// false if there are no workers at all; tiles the workers didn't finish are rendered here
+	bool render_farm() {
+		tile_farm farm( m_worker_cmd, m_procs );
+		if ( !farm.workers() ) return false;
+		// only the tiles already back are resolved, the rest of m_hdr is still being written
+		auto progress = [this]( const tile_farm::tile & t ) {
+			resolve_tile( t );
+			if ( frame_due() ) update();
+		};
+		if ( farm.render( &m_hdr[0], m_w * 16, m_w, m_h, 16, farm_tile, progress ) ) return true;
+
+		std::vector <tile_farm::tile> left = farm.unfinished();
+		#pragma omp parallel for schedule(dynamic)
+		for ( int i = 0; i < (int)left.size(); i++ ) {
+			const tile_farm::tile & t = left[i];
+			m_tracer.render_rect( t.x0, t.y0, t.x1, t.y1, m_w, m_h, m_passes, &m_hdr[(m_w * t.y0 + t.x0) * 4], m_w * 4 );
+			resolve_tile( t );
+			if ( omp_get_thread_num() == 0 && frame_due() ) update();
+		}
+		return true;
+	}
+
+	// tile t of m_hdr holding all passes to m_ptr
+	void resolve_tile( const tile_farm::tile & t ) {
+		for ( int y = t.y0; y < t.y1; y++ ) {
+			m_resolve.resolve( &m_hdr[(m_w * y + t.x0) * 4], m_ptr + m_w * y + t.x0, t.x1 - t.x0, 1.f / m_passes );
 		}
+	}
+
+	// rows [y0, y1) of m_hdr holding passes passes to m_ptr
+	void resolve( int y0, int y1, unsigned passes ) {
+		m_resolve.resolve( &m_hdr[m_w * y0 * 4], m_ptr + m_w * y0, m_w * (y1 - y0), 1.f / passes );
 		update();
 	}
+
+public:
+	the_ray_tracer( int x, int y, int w, int h )
+		: window( x, y, w, h, 1, true /* async present */ ),
+			m_extra_lights(0), m_light_samples(0), m_mesh(false), m_passes(1), m_procs(0), m_worker_cmd(NULL), m_sink(NULL) {}
+	virtual ~the_ray_tracer() {}
+
+	void set_lights( unsigned extra_lights, unsigned samples ) {
+		m_extra_lights = extra_lights;
+		m_light_samples = samples;
+	}
+
+	void set_mesh( bool mesh ) { m_mesh = mesh; }
+	void set_passes( unsigned passes ) { m_passes = passes ? passes : 1; }
+
+	void set_tone( float exposure, hdr_resolve::tone_map tm, bool srgb ) {
+		m_resolve.set_exposure( exposure );
+		m_resolve.set_tone_map( tm );
+		m_resolve.set_srgb( srgb );
+	}
+
+	// render with procs worker processes started by cmd_line
+	void set_workers( unsigned procs, const char * cmd_line ) {
+		m_procs = procs;
+		m_worker_cmd = cmd_line;
+	}
+
+	// the finished frame goes to sink, then the window closes
+	void set_sink( frame_sink * sink ) { m_sink = sink; }
+
+	void on_create() {
+
+		// create scene
+		m_tracer.create_scene( m_extra_lights, m_light_samples, m_mesh );
+		m_hdr.assign( m_w * m_h * 4, 0 );
+
+		// render scene, locally if there are no workers
+		if ( !m_procs || !render_farm() ) {
+			for ( unsigned pass = 0; pass < m_passes; pass++ ) {
+				#pragma omp parallel for
+				for ( int y = 0; y < m_h; y++ ) {
+					for ( int x = 0; x < m_w; x++ ) {
+						m_tracer.add_pixel( x, y, m_w, m_h, pass, &m_hdr[(m_w * y + x) * 4] );
+					}
+					m_resolve.resolve( &m_hdr[m_w * y * 4], m_ptr + m_w * y, m_w, 1.f / (pass + 1) );
+
+					if ( omp_get_thread_num() == 0 && frame_due() ) {
+						update(); // a copy of the frame, at most once a refresh interval
+					}
+				}
+			}
+		}
+		resolve( 0, m_h, m_passes );
+
+		if ( m_sink ) {
+			m_sink->write( m_ptr );
+			PostQuitMessage( 0 );
+		}
+	}
+
+	// the frame is kept in HDR, so exposure and tone mapping only take a resolve:
+	// left / right click - half a stop up / down, middle click - next tone map
+	void on_lbutton_down( float, float, int ) {
+		m_resolve.set_exposure( m_resolve.exposure() * 1.41421356f );
+		resolve( 0, m_h, m_passes );
+	}
+
+	void on_rbutton_down( float, float, int ) {
+		m_resolve.set_exposure( m_resolve.exposure() / 1.41421356f );
+		resolve( 0, m_h, m_passes );
+	}
+
+	void on_mbutton_down( float, float, int ) {
+		m_resolve.set_tone_map( (hdr_resolve::tone_map)((m_resolve.get_tone_map() + 1) % hdr_resolve::tm_count) );
+		resolve( 0, m_h, m_passes );
+	}
 };
 
+// tile farm worker: renders tiles requested over stdin to stdout, HDR pixels
+// with all passes summed up, the same as the local render
+static void serve_tiles( unsigned lights, unsigned samples, bool mesh, unsigned passes ) {
+	ray_tracer tracer;
+	tracer.create_scene( lights, samples, mesh );
+	tile_farm::serve( 16, [&tracer, passes]( const tile_farm::tile & t, uint8_t * dst ) {
+		tracer.render_rect( t.x0, t.y0, t.x1, t.y1, t.w, t.h, passes, (float *)dst, (t.x1 - t.x0) * 4 );
+	} );
+}
+
+// tile farm self-test: the w x h frame rendered here with OpenMP, then by procs workers
+// started with cmd_line, times to stderr; 0 if the workers ran and both frames are the same
+static int test_farm( int w, int h, unsigned lights, unsigned samples, bool mesh, unsigned passes, unsigned procs, const char * cmd_line ) {
+	ray_tracer tracer;
+	tracer.create_scene( lights, samples, mesh );
+	std::vector <float> here( w * h * 4 ), farmed( w * h * 4 );
+
+	DWORD t0 = GetTickCount();
+	#pragma omp parallel for schedule(dynamic)
+	for ( int y = 0; y < h; y++ ) {
+		tracer.render_rect( 0, y, w, y + 1, w, h, passes, &here[w * y * 4], w * 4 );
+	}
+
+	// starting the workers is timed too, they build the scene the same as here
+	DWORD t1 = GetTickCount();
+	bool ok;
+	{
+		tile_farm farm( cmd_line, procs );
+		ok = farm.workers() && farm.render( &farmed[0], w * 16, w, h, 16, farm_tile, []( const tile_farm::tile & ) {} );
+	}
+	DWORD t2 = GetTickCount();
+
+	if ( !ok ) {
+		fprintf( stderr, "rt: the %u workers failed\n", procs );
+		return 1;
+	}
+	bool same = !memcmp( &here[0], &farmed[0], here.size() * sizeof( float ) );
+	fprintf( stderr, "rt: %d threads here %lu ms, %u workers %lu ms, speedup %.2f, frames %s\n",
+		omp_get_max_threads(), t1 - t0, procs, t2 - t1, (t1 - t0) / (double)std::max( t2 - t1, (DWORD)1 ), same ? "match" : "differ" );
+	return same ? 0 : 1;
+}
+
 int APIENTRY WinMain( HINSTANCE hInst, HINSTANCE hPInst, LPSTR lpCmdLine, int nCmdShow )
 {
+	// rt.exe [-o file|- [-raw]] [-lights n [-samples k]] [-mesh] [-passes n] [-procs n]
+	//        [-exposure e] [-tonemap clamp|reinhard|aces] [-srgb]
+	// rt.exe -workers n [scene options] - tile farm self-test against n workers, no window
+	const char *out = NULL;
+	bool raw = false, worker = false, mesh = false, srgb = false;
+	unsigned lights = 0, samples = 0, procs = 0, passes = 1, test_workers = 0;
+	float exposure = 1;
+	hdr_resolve::tone_map tm = hdr_resolve::tm_clamp;
+	for ( char *arg = strtok( lpCmdLine, " " ); arg; arg = strtok( NULL, " " ) ) {
+		if ( !strcmp( arg, "-o" ) ) out = strtok( NULL, " " );
+		else if ( !strcmp( arg, "-raw" ) ) raw = true;
+		else if ( !strcmp( arg, "-worker" ) ) worker = true;
+		else if ( !strcmp( arg, "-mesh" ) ) mesh = true;
+		else if ( !strcmp( arg, "-lights" ) && (arg = strtok( NULL, " " )) ) lights = atoi( arg );
+		else if ( !strcmp( arg, "-samples" ) && (arg = strtok( NULL, " " )) ) samples = atoi( arg );
+		else if ( !strcmp( arg, "-procs" ) && (arg = strtok( NULL, " " )) ) procs = atoi( arg );
+		else if ( !strcmp( arg, "-workers" ) && (arg = strtok( NULL, " " )) ) test_workers = atoi( arg );
+		else if ( !strcmp( arg, "-passes" ) && (arg = strtok( NULL, " " )) ) passes = std::max( 1, atoi( arg ) );
+		else if ( !strcmp( arg, "-exposure" ) && (arg = strtok( NULL, " " )) ) exposure = atof( arg );
+		else if ( !strcmp( arg, "-srgb" ) ) srgb = true;
+		else if ( !strcmp( arg, "-tonemap" ) && (arg = strtok( NULL, " " )) ) {
+			if ( !strcmp( arg, "reinhard" ) ) tm = hdr_resolve::tm_reinhard;
+			else if ( !strcmp( arg, "aces" ) ) tm = hdr_resolve::tm_aces;
+			else tm = hdr_resolve::tm_clamp;
+		}
+	}
+
+	if ( worker ) {
+		serve_tiles( lights, samples, mesh, passes );
+		return 0;
+	}
+
+	// workers must build the very same scene
+	char exe[MAX_PATH], worker_cmd[MAX_PATH + 128];
+	GetModuleFileName( NULL, exe, MAX_PATH );
+	snprintf( worker_cmd, sizeof( worker_cmd ), "\"%s\" -worker -lights %u -samples %u -passes %u%s", exe, lights, samples, passes, mesh ? " -mesh" : "" );
+
+	if ( test_workers ) return test_farm( 800, 600, lights, samples, mesh, passes, test_workers, worker_cmd );
+
 	the_ray_tracer rt( -1, -1, 800, 600 );
+	rt.set_lights( lights, samples );
+	rt.set_mesh( mesh );
+	rt.set_passes( passes );
+	rt.set_tone( exposure, tm, srgb );
+	rt.set_workers( procs, worker_cmd );
+
+	FILE *f = out ? frame_sink::open( out ) : NULL;
+	frame_sink *sink = f ? new frame_sink( f, 800, 600, 1, raw ? frame_sink::raw_rgba : frame_sink::y4m ) : NULL;
+	rt.set_sink( sink );
+
 	rt.idle( false );
-	return 0;
+	int res = 0;
+	if ( sink && !sink->finish() ) {
+		fprintf( stderr, "rt: writing %s failed, the output is incomplete\n", out );
+		res = 1;
+	}
+	delete sink;
+	if ( f && f != stdout ) fclose( f );
+	return res;
 }
@@ -0,0 +1,234 @@
+//----------------------------------------------------------------------------
+// FX Project
+// Copyright (C) 2013 Anton Sazonov (lazybiz)
+//
+// Permission to copy, use, modify, sell and distribute this software 
+// is granted provided this copyright notice appears in all copies. 
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+// Contact: lazybiz@yandex.ru
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Spot particle system. The state of all spots is kept as structure of
+// arrays and updated four spots at a time with SSE2, sin/cos included
+// (fast_math.h). A spot which reaches the end of its life is queued for
+// respawn by the update itself (a branch-free stream compaction), the same
+// pass compacts the spots worth drawing into the visible list.
+//
+//----------------------------------------------------------------------------
+
+#ifndef __SPOT_SYSTEM_H__
+#define __SPOT_SYSTEM_H__
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+
+// lanes set in a 4-bit mask, packed to the front, and their count
+static int32_t const g_spot_compact[16][4] = {
+	{ 0, 0, 0, 0 }, { 0, 0, 0, 0 }, { 1, 0, 0, 0 }, { 0, 1, 0, 0 },
+	{ 2, 0, 0, 0 }, { 0, 2, 0, 0 }, { 1, 2, 0, 0 }, { 0, 1, 2, 0 },
+	{ 3, 0, 0, 0 }, { 0, 3, 0, 0 }, { 1, 3, 0, 0 }, { 0, 1, 3, 0 },
+	{ 2, 3, 0, 0 }, { 0, 2, 3, 0 }, { 1, 2, 3, 0 }, { 0, 1, 2, 3 } };
+
+static uint8_t const g_spot_popcount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+#endif
+
+class spot_system {
+	int		m_maxx, m_maxy;
+	float	m_maxr;
+	float	m_margin;		// visible spots may be this far off the screen, their blur reaches it
+	size_t	m_count;
+	uint64_t m_seed;
+
+	std::vector <float>		m_x, m_y;
+	std::vector <float>		m_dx, m_dy;		// motion delta
+	std::vector <float>		m_ddx, m_ddy;	// dx delta
+	std::vector <float>		m_r0, m_r1;
+	std::vector <float>		m_maxa;
+	std::vector <int32_t>	m_lifephase;	// phase [0 <= m_lifetime], radius and alpha follow from it
+	std::vector <int32_t>	m_lifetime;		// cycles
+	std::vector <int32_t>	m_blur_radius;
+
+	// lists of the spots to respawn and to draw
+	struct chunk_lists {
+		uint32_t *	respawn;
+		uint32_t *	visible;
+		size_t		respawn_count, visible_count;
+	};
+
+	// a chunk of spots is updated by one thread and fills its own part of the
+	// lists (chunk + 3 entries, compaction writes ahead), the parts are joined after
+	std::vector <uint32_t>	m_respawn;		// spots to respawn on the next update
+	size_t					m_respawn_count;
+	std::vector <uint32_t>	m_visible;
+	size_t					m_visible_count;
+	std::vector <chunk_lists> m_chunks;
+
+	enum {
+		fade = 50,		// cycles of fade in and fade out
+		chunk = 4096	// spots, a multiple of 4
+	};
+
+	static size_t chunk_count( size_t count ) { return (count + chunk - 1) / chunk; }
+
+	void respawn( uint32_t i, uint32_t frame ) {
+		counter_rng rng( m_seed, i, frame ); // a spot is reborn at most once per frame
+		m_x[i] = rng.uniform( 0, m_maxx - 1 );
+		m_y[i] = rng.uniform( 0, m_maxy - 1 );
+		m_dx[i] = rng.uniform( 0, 1 ) - .5;
+		m_dy[i] = rng.uniform( 0, 1 ) - .5;
+		m_ddx[i] = rng.uniform( 0, .05 ) - .05;
+		m_ddy[i] = rng.uniform( 0, .05 ) - .05;
+		m_r1[i] = rng.uniform( m_maxr / 5., m_maxr );
+		m_r0[i] = rng.uniform( m_r1[i] / 2, m_r1[i] );
+		m_maxa[i] = rng.uniform_int( 10, 255 );
+		m_lifetime[i] = (int)rng.uniform( 150, 800 );
+		m_lifephase[i] = 0;
+	}
+
+	// alpha fades in and out over the life
+	static int alpha( int phase, int lifetime, float maxa ) {
+		int f = std::min( std::min( phase, (int)fade ), lifetime - phase );
+		return (int)((float)f * maxa * (1.f / fade));
+	}
+
+	// one spot, exactly what the SSE2 path does for four
+	void step( size_t i, chunk_lists & out ) {
+		m_x[i] += fx_math::sin( m_dx[i] ) * .5f;
+		m_y[i] += fx_math::cos( m_dy[i] ) * .5f;
+		m_dx[i] += m_ddx[i];
+		m_dy[i] += m_ddy[i];
+
+		int phase = m_lifephase[i], lifetime = m_lifetime[i];
+		int a = alpha( phase, lifetime, m_maxa[i] );
+
+		m_lifephase[i] = ++phase;
+		out.respawn[out.respawn_count] = i;
+		out.respawn_count += phase == lifetime;
+
+		// the radius never exceeds r1
+		float e = m_r1[i] + m_margin;
+		bool visible = a > 0 && m_x[i] + e > 0 && m_x[i] - e < m_maxx && m_y[i] + e > 0 && m_y[i] - e < m_maxy;
+		out.visible[out.visible_count] = i;
+		out.visible_count += visible;
+	}
+
+	void update( size_t i, size_t end, chunk_lists & out ) {
+		size_t respawn_count = 0, visible_count = 0;
+#if defined( __SSE2__ )
+		const __m128 v_half = _mm_set1_ps( .5f );
+		const __m128i v_fade = _mm_set1_epi32( fade );
+		const __m128i v_one = _mm_set1_epi32( 1 );
+		const __m128 v_margin = _mm_set1_ps( m_margin );
+		const __m128 v_maxx = _mm_set1_ps( m_maxx ), v_maxy = _mm_set1_ps( m_maxy );
+		for ( ; i + 4 <= end; i += 4 ) {
+			__m128 dx = _mm_loadu_ps( &m_dx[i] ), dy = _mm_loadu_ps( &m_dy[i] );
+			__m128 x = _mm_add_ps( _mm_loadu_ps( &m_x[i] ), _mm_mul_ps( fx_math::sin( dx ), v_half ) );
+			__m128 y = _mm_add_ps( _mm_loadu_ps( &m_y[i] ), _mm_mul_ps( fx_math::cos( dy ), v_half ) );
+			_mm_storeu_ps( &m_x[i], x );
+			_mm_storeu_ps( &m_y[i], y );
+			_mm_storeu_ps( &m_dx[i], _mm_add_ps( dx, _mm_loadu_ps( &m_ddx[i] ) ) );
+			_mm_storeu_ps( &m_dy[i], _mm_add_ps( dy, _mm_loadu_ps( &m_ddy[i] ) ) );
+
+			__m128i phase = _mm_loadu_si128( (__m128i *)&m_lifephase[i] );
+			__m128i lifetime = _mm_loadu_si128( (__m128i *)&m_lifetime[i] );
+
+			// min( phase, fade, lifetime - phase ), SSE2 has no 32-bit integer min
+			__m128i f = phase;
+			__m128i left = _mm_sub_epi32( lifetime, phase );
+			__m128i m = _mm_cmpgt_epi32( f, v_fade );
+			f = _mm_or_si128( _mm_and_si128( m, v_fade ), _mm_andnot_si128( m, f ) );
+			m = _mm_cmpgt_epi32( f, left );
+			f = _mm_or_si128( _mm_and_si128( m, left ), _mm_andnot_si128( m, f ) );
+			__m128i a = _mm_cvttps_epi32( _mm_mul_ps( _mm_mul_ps( _mm_cvtepi32_ps( f ), _mm_loadu_ps( &m_maxa[i] ) ), _mm_set1_ps( 1.f / fade ) ) );
+
+			phase = _mm_add_epi32( phase, v_one );
+			_mm_storeu_si128( (__m128i *)&m_lifephase[i], phase );
+
+			__m128 e = _mm_add_ps( _mm_loadu_ps( &m_r1[i] ), v_margin );
+			__m128 vis = _mm_castsi128_ps( _mm_cmpgt_epi32( a, _mm_setzero_si128() ) );
+			vis = _mm_and_ps( vis, _mm_cmpgt_ps( _mm_add_ps( x, e ), _mm_setzero_ps() ) );
+			vis = _mm_and_ps( vis, _mm_cmplt_ps( _mm_sub_ps( x, e ), v_maxx ) );
+			vis = _mm_and_ps( vis, _mm_cmpgt_ps( _mm_add_ps( y, e ), _mm_setzero_ps() ) );
+			vis = _mm_and_ps( vis, _mm_cmplt_ps( _mm_sub_ps( y, e ), v_maxy ) );
+
+			// compaction: four indices are written, only the selected ones are kept
+			unsigned dead = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( phase, lifetime ) ) );
+			unsigned seen = _mm_movemask_ps( vis );
+			__m128i base = _mm_set1_epi32( i );
+			_mm_storeu_si128( (__m128i *)&out.respawn[respawn_count], _mm_add_epi32( base, _mm_loadu_si128( (const __m128i *)g_spot_compact[dead] ) ) );
+			respawn_count += g_spot_popcount[dead];
+			_mm_storeu_si128( (__m128i *)&out.visible[visible_count], _mm_add_epi32( base, _mm_loadu_si128( (const __m128i *)g_spot_compact[seen] ) ) );
+			visible_count += g_spot_popcount[seen];
+		}
+#endif
+		out.respawn_count = respawn_count;
+		out.visible_count = visible_count;
+		for ( ; i < end; i++ ) {
+			step( i, out );
+		}
+	}
+
+public:
+	// blur radii are picked from [1, max_blur_radius], seed picks everything
+	spot_system( size_t count, int w, int h, float maxr, int max_blur_radius, uint64_t seed )
+		: m_maxx(w), m_maxy(h), m_maxr(maxr), m_margin(max_blur_radius), m_count(count), m_seed(seed),
+			m_x(count), m_y(count), m_dx(count), m_dy(count), m_ddx(count), m_ddy(count),
+			m_r0(count), m_r1(count), m_maxa(count),
+			m_lifephase(count), m_lifetime(count), m_blur_radius(count),
+			m_respawn( chunk_count( count ) * (chunk + 4) ), m_respawn_count(count),
+			m_visible( chunk_count( count ) * (chunk + 4) ), m_visible_count(0), m_chunks( chunk_count( count ) ) {
+		counter_rng rng( m_seed, ~0u /* the system's own stream */, 0 );
+		for ( size_t i = 0; i < count; i++ ) {
+			m_blur_radius[i] = rng.uniform_int( 1, max_blur_radius );
+			m_respawn[i] = i; // all of them are born on the first update
+		}
+	}
+
+	size_t size() const { return m_count; }
+
+	// spots with a > 0 which may touch the screen, in index order
+	const uint32_t * visible() const { return &m_visible[0]; }
+	size_t visible_count() const { return m_visible_count; }
+
+	// the state the last update() moved the spot to
+	float x( uint32_t i ) const { return m_x[i]; }
+	float y( uint32_t i ) const { return m_y[i]; }
+	float r( uint32_t i ) const {
+		int phase = m_lifephase[i] - 1;
+		return m_r0[i] + (m_r1[i] - m_r0[i]) / (float)(m_lifetime[i] * phase + 1); // interpolate radius
+	}
+	uint32_t a( uint32_t i ) const { return alpha( m_lifephase[i] - 1, m_lifetime[i], m_maxa[i] ); }
+	int blur_radius( uint32_t i ) const { return m_blur_radius[i]; }
+
+	// one step of life for every spot, frame keys the random numbers of the respawned ones
+	void update( uint32_t frame ) {
+		int n = m_respawn_count;
+		#pragma omp parallel for
+		for ( int k = 0; k < n; k++ ) {
+			respawn( m_respawn[k], frame );
+		}
+
+		n = m_chunks.size();
+		#pragma omp parallel for
+		for ( int c = 0; c < n; c++ ) {
+			chunk_lists & l = m_chunks[c];
+			l.respawn = &m_respawn[c * (chunk + 4)];
+			l.visible = &m_visible[c * (chunk + 4)];
+			update( c * chunk, std::min( (size_t)(c + 1) * chunk, m_count ), l );
+		}
+
+		m_respawn_count = m_visible_count = 0;
+		for ( auto & l : m_chunks ) {
+			memmove( &m_respawn[m_respawn_count], l.respawn, l.respawn_count * sizeof( uint32_t ) );
+			memmove( &m_visible[m_visible_count], l.visible, l.visible_count * sizeof( uint32_t ) );
+			m_respawn_count += l.respawn_count;
+			m_visible_count += l.visible_count;
+		}
+	}
+};
+
+#endif // __SPOT_SYSTEM_H__
@@ -14,26 +14,29 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cmath>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
-#include <random>
+#include <functional>
 #include <vector>
 
 #include "../image.h"
 #include "../window.h"
 #include "../stack_blur8.h"
+#include "../fast_math.h"
+#include "../disc_raster8.h"
+#include "../bilinear32.h"
+#include "../dynamic_resolution.h"
+#include "../frame_sink.h"
+#include "../counter_rng.h"
+#include "spot_system.h"
 
 #define MAKE_COLOR( r, g, b, a )	(((a) << 24) | ((r) << 16) | ((g) << 8) | (b))
 
-static std::mt19937 rng;
-static std::uniform_int_distribution <int> fdist( 0, 1000000 );
-
-float my_rand( float min, float max ) {
-	float r = fdist( rng ) / 1000000.;
-	return r * (max - min) + min;
-}
-
 uint32_t lerp_color( uint32_t *a, uint32_t *b, uint32_t delta /* 0 - 255 */ ) {
 	uint32_t aa, ar, ag, ab;
 	aa = (*a >> 24) & 0xff;
@@ -55,218 +58,338 @@ uint32_t lerp_color( uint32_t *a, uint32_t *b, uint32_t delta /* 0 - 255 */ ) {
 	return (aa << 24) | (ar << 16) | (ag << 8) | ab;
 }
 
-struct rect {
-	int	x0, y0;
-	int	x1, y1;
-};
+int scaled_radius( int r, float s ) {
+	r = (int)(r * s + .5f);
+	return r > 0 ? r : 1;
+}
 
-class live_spot {
-	int			m_maxx;
-	int			m_maxy;
-	float		m_maxr;
-
-	float		m_x, m_y;
-	float		m_r, m_r0, m_r1;
-	float		m_dx, m_dy;		// motion delta
-	float		m_ddx, m_ddy;	// dx delta
-	uint32_t	m_a, m_maxa;
-	int			m_lifephase;	// phase [0 <= m_lifetime]
-	int			m_lifetime;		// cycles
-
-	stack_blur8	m_blur;
-	int			m_blur_radius;
-	//int			m_blur_radius_max;
-
-	image <uint8_t> m_temp_buffer;
-	rect		m_rc;
-
-	void blend_pixel( uint32_t *ptr, int pitch, int x, int y, uint32_t c ) {
-		uint32_t *p = ptr + pitch * y + x;
-		uint32_t s = *p;
-
-		uint32_t sr, sg, sb;
-		sr = (s >> 16) & 0xff;
-		sg = (s >>  8) & 0xff;
-		sb =  s        & 0xff;
-
-		uint32_t ca, cr, cg, cb;
-		ca = (c >> 24) & 0xff;
-		cr = (c >> 16) & 0xff;
-		cg = (c >>  8) & 0xff;
-		cb =  c        & 0xff;
-
-		cr = ((cr * ca) + (sr * (255 - ca))) >> 8;
-		cg = ((cg * ca) + (sg * (255 - ca))) >> 8;
-		cb = ((cb * ca) + (sb * (255 - ca))) >> 8;
-
-		*p = /*(ca << 24) |*/ (cr << 16) | (cg << 8) | cb;
-	}
+void blend_pixel( uint32_t *ptr, int pitch, int x, int y, uint32_t c ) {
+	uint32_t *p = ptr + pitch * y + x;
+	uint32_t s = *p;
 
-	/* x and y can be out of bound */
-	bool render_spot( image <uint8_t> buffer, float x, float y, float r ) {
-		m_rc.x0 = floor( x - r );
-		m_rc.y0 = floor( y - r );
-		m_rc.x1 = ceil( x + r );
-		m_rc.y1 = ceil( y + r );
-
-		// ugly? yes!
-		if ( m_rc.x0 < 0 ) m_rc.x0 = 0; else if ( m_rc.x0 > buffer.width()  ) m_rc.x0 = buffer.width();
-		if ( m_rc.y0 < 0 ) m_rc.y0 = 0; else if ( m_rc.y0 > buffer.height() ) m_rc.y0 = buffer.height();
-		if ( m_rc.x1 >= buffer.width()  ) m_rc.x1 = buffer.width();  else if ( m_rc.x1 < 0 ) m_rc.x1 = 0;
-		if ( m_rc.y1 >= buffer.height() ) m_rc.y1 = buffer.height(); else if ( m_rc.y1 < 0 ) m_rc.y1 = 0;
-		if ( m_rc.x0 == m_rc.x1 || m_rc.y0 == m_rc.y1 ) return false;
-
-		for ( int iy = m_rc.y0; iy < m_rc.y1; iy++ ) {
-			for ( int ix = m_rc.x0; ix < m_rc.x1; ix++ ) {
-				float dx = x - ix;
-				float dy = y - iy;
-				float d = sqrt( dx * dx + dy * dy );
-				uint8_t alpha;
-				if ( d < r ) {
-					float rd = r - d;
-					if ( rd < 1 ) {
-						alpha = (uint8_t)(rd * 255);
-					} else alpha = 255;
-				} else alpha = 0;
-				*(buffer.pix_ptr( ix, iy )) = alpha;
-			}
-		}
-		return true;
-	}
+	uint32_t sr, sg, sb;
+	sr = (s >> 16) & 0xff;
+	sg = (s >>  8) & 0xff;
+	sb =  s        & 0xff;
 
-public:
-	live_spot( int w, int h, int maxr, int blur_radius/*, int blur_radius_max*/ )
-		: m_maxx(w), m_maxy(h), m_maxr(maxr), m_blur_radius(blur_radius), m_temp_buffer( new uint8_t [w * h], w, h, w ) {
-		m_lifephase = m_lifetime = 0;
-	}
+	uint32_t ca, cr, cg, cb;
+	ca = (c >> 24) & 0xff;
+	cr = (c >> 16) & 0xff;
+	cg = (c >>  8) & 0xff;
+	cb =  c        & 0xff;
 
-	~live_spot() {
-		delete [] m_temp_buffer.ptr();
-	}
+	cr = ((cr * ca) + (sr * (255 - ca))) >> 8;
+	cg = ((cg * ca) + (sg * (255 - ca))) >> 8;
+	cb = ((cb * ca) + (sb * (255 - ca))) >> 8;
+
+	*p = /*(ca << 24) |*/ (cr << 16) | (cg << 8) | cb;
+}
 
-	void render( int w, int h ) {
+// blend white through an alpha mask (scaled by a / 256) and clear the mask
+void blit_alpha( uint32_t *dst, int pitch, image <uint8_t> & mask, const rect & rc, uint32_t a ) {
+	for ( int y = rc.y0; y < rc.y1; y++ ) {
+		uint8_t *p = mask.pix_ptr( rc.x0, y );
+		for ( int x = rc.x0; x < rc.x1; x++, p++ ) {
+			uint32_t c = 0xffffff;
+			c |= (((uint32_t)*p * a) >> 8) << 24;
+			blend_pixel( dst, pitch, x, y, c );
+
+			// clear old value
+			*p = 0;
+		}
+	}
+}
 
-		if ( !render_spot( m_temp_buffer, m_x, m_y, m_r ) ) return; // out of screen
+// grow rc by radius, clipped to w x h
+void expand_bounds( rect & rc, int radius, int w, int h ) {
+	rc.x0 = std::max( rc.x0 - radius, 0 );
+	rc.y0 = std::max( rc.y0 - radius, 0 );
+	rc.x1 = std::min( rc.x1 + radius, w );
+	rc.y1 = std::min( rc.y1 + radius, h );
+}
 
-		// expand bounds
-		m_rc.x0 -= m_blur_radius;
-		m_rc.y0 -= m_blur_radius;
-		m_rc.x1 += m_blur_radius;
-		m_rc.y1 += m_blur_radius;
-		if ( m_rc.x0 < 0 ) m_rc.x0 = 0;
-		if ( m_rc.y0 < 0 ) m_rc.y0 = 0;
-		if ( m_rc.x1 >= w ) m_rc.x1 = w;
-		if ( m_rc.y1 >= h ) m_rc.y1 = h;
+// disc (x, y, r) as disc_raster8 clips it, grown by the blur radius
+bool spot_bounds( float x, float y, float r, int blur_radius, int w, int h, rect & rc ) {
+	rc.x0 = std::max( (int)floor( x - r ), 0 );
+	rc.y0 = std::max( (int)floor( y - r ), 0 );
+	rc.x1 = std::min( (int)ceil( x + r ), w );
+	rc.y1 = std::min( (int)ceil( y + r ), h );
+	if ( rc.x0 >= rc.x1 || rc.y0 >= rc.y1 ) return false;
+	expand_bounds( rc, blur_radius, w, h );
+	return true;
+}
 
-		image <uint8_t> subimg( m_temp_buffer.pix_ptr( m_rc.x0, m_rc.y0 ), m_rc.x1 - m_rc.x0, m_rc.y1 - m_rc.y0, m_temp_buffer.stride() );
-		m_blur.process( subimg, m_blur_radius, m_blur_radius );
-	}
+// all spots of one depth share an alpha layer; overlapping spots are merged
+// into one region, so every region of the layer is blurred only once per frame
+struct depth_layer {
+	image <uint8_t>		m_alpha;
+	std::vector <rect>	m_regions;	// disjoint areas touched this frame
+	int					m_blur_radius;
 
-	void blit( uint32_t *dst, int w, int h ) {
-		for ( int y = m_rc.y0; y < m_rc.y1; y++ ) {
-			for ( int x = m_rc.x0; x < m_rc.x1; x++ ) {
-				uint32_t c = 0xffffff;
-				c |= (((uint32_t)(*(m_temp_buffer.pix_ptr( x, y ))) * m_a) >> 8) << 24;
-				blend_pixel( dst, w, x, y, c );
+	depth_layer( int w, int h, int blur_radius )
+		: m_alpha( new uint8_t [w * h](), w, h, w ), m_blur_radius(blur_radius) {}
 
-				// clear old value
-				*(m_temp_buffer.pix_ptr( x, y )) = 0;
-			}
-		}
+	static bool overlap( const rect & a, const rect & b ) {
+		return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
 	}
 
-	void lifecycle() {
-		if ( m_lifephase == m_lifetime ) {
-			std::uniform_int_distribution <int> fdist_10_255( 10, 255 );
-			m_x = my_rand( 0, m_maxx - 1 );
-			m_y = my_rand( 0, m_maxy - 1 );
-			m_dx = my_rand( 0, 1 ) - .5;
-			m_dy = my_rand( 0, 1 ) - .5;
-			m_ddx = my_rand( 0, .05 ) - .05;
-			m_ddy = my_rand( 0, .05 ) - .05;
-			m_r1 = my_rand( m_maxr / 5., m_maxr );
-			m_r0 = my_rand( m_r1 / 2, m_r1 );
-
-			// we must calc. depth value for depth-of-field fx.
-			//m_maxa = (float)m_blur_radius / m_blur_radius_max * 255;//fdist_10_255( rng );
-			m_maxa = fdist_10_255( rng );
-
-			m_lifetime = (int)my_rand( 150, 800 );
-			m_lifephase = 0;
+	void add_region( rect rc ) {
+		// grow until nothing overlaps, a merged region may reach others
+		for ( size_t i = 0; i < m_regions.size(); ) {
+			const rect & r = m_regions[i];
+			if ( overlap( r, rc ) ) {
+				if ( r.x0 < rc.x0 ) rc.x0 = r.x0;
+				if ( r.y0 < rc.y0 ) rc.y0 = r.y0;
+				if ( r.x1 > rc.x1 ) rc.x1 = r.x1;
+				if ( r.y1 > rc.y1 ) rc.y1 = r.y1;
+				m_regions[i] = m_regions.back();
+				m_regions.pop_back();
+				i = 0;
+			} else i++;
 		}
+		m_regions.push_back( rc );
+	}
+};
 
-		m_x += sin( m_dx ) * .5;
-		m_y += cos( m_dy ) * .5;
-		m_dx += m_ddx;
-		m_dy += m_ddy;
-
-		m_r = m_r0 + (m_r1 - m_r0) / (m_lifetime * m_lifephase + 1); // interpolate radius
+enum {
+	max_blur_radius = 10
+};
 
-		if ( m_lifephase <= 50 ) {
-			m_a = (uint8_t)(m_lifephase / 50. * m_maxa);
-		} else
-		if ( m_lifephase > m_lifetime - 50 ) {
-			m_a = (uint8_t)(m_maxa - ((m_lifephase - (m_lifetime - 50)) / 50. * m_maxa));
+void make_background( uint32_t *dst, int pitch, int w, int h ) {
+	float half_diag = sqrt( (w / 2) * (w / 2) + (h / 2) * (h / 2) );
+	for ( int y = 0; y < h; y++ ) {
+		for ( int x = 0; x < w; x++ ) {
+			float dx = x - w / 2;
+			float dy = y - h / 2;
+			float d = sqrt( dx * dx + dy * dy );
+
+			uint32_t a = 0x0000ff;
+			uint32_t b = MAKE_COLOR( 100, 190, 250, 0 );
+			dst[pitch * y + x] = lerp_color( &a, &b, d / half_diag * 255 );
 		}
-
-		m_lifephase++;
 	}
-};
+}
 
 class the_app : public window {
 	uint32_t *					m_background;
-	std::vector <live_spot *>	m_spots;
-	std::vector <int>			m_blurriness;
+	spot_system *				m_spots;
+	size_t						m_spot_count;
+	int							m_dof_layers;	// 0 - blur every spot on its own
+	std::vector <depth_layer>	m_layers;		// by blur radius, sharpest (nearest the focal plane) first
+
+	// per-spot blur: every visible spot gets its own mask of its bounds in m_mask_pool
+	std::vector <rect>			m_mask_rc;
+	std::vector <size_t>		m_mask_offset;
+	std::vector <uint8_t>		m_mask_pool;
+
+	// everything to blur this frame, layer regions or spot masks, done in one batch
+	std::vector <stack_blur8::region>	m_blur_regions;
+
+	// dynamic resolution: the frame is rendered with a pitch of m_w into m_frame at
+	// m_render_w x m_render_h and upscaled into m_ptr, unless it's rendered at full size
+	dynamic_resolution *		m_dyn_res;		// NULL - always full size
+	bilinear32					m_upscale;
+	uint32_t *					m_frame;
+	int							m_render_w, m_render_h;
+
+	frame_sink *				m_sink;			// offline rendering, NULL - on screen only
+	int							m_frames;		// frames to render, 0 - until closed
+	uint64_t					m_seed;			// same seed, same animation
+	uint32_t					m_frame_no;
+	DWORD						m_stats_tick;	// last report of the present counters
+
+	// spots with a bigger blur radius are farther from the focal plane
+	int layer_of( int blur_radius ) const {
+		return (blur_radius - 1) * m_dof_layers / max_blur_radius;
+	}
+
+	// present counters go to the debugger output once a second
+	void report_stats() {
+		DWORD now = GetTickCount();
+		if ( now - m_stats_tick < 1000 ) return;
+		m_stats_tick = now;
+		frame_stats fs = stats();
+		char msg[128];
+		snprintf( msg, sizeof( msg ), "spots: %u rendered, %u presented, %u dropped, %u repeated\n",
+			fs.rendered, fs.presented, fs.dropped, fs.repeated );
+		OutputDebugString( msg );
+	}
 
 public:
-	the_app( int x, int y, int w, int h, int scale = 1 ) : window( x, y, w, h, scale ) {}
-	virtual ~the_app() {}
+	/* frame_budget_ms > 0 enables dynamic resolution */
+	the_app( int x, int y, int w, int h, int scale = 1, int dof_layers = 0, double frame_budget_ms = 0 )
+		: window( x, y, w, h, scale, true /* async present */ ), m_spots(NULL), m_spot_count(64), m_dof_layers(dof_layers),
+			m_dyn_res( frame_budget_ms > 0 ? new dynamic_resolution( frame_budget_ms ) : NULL ),
+			m_sink(NULL), m_frames(0), m_seed(0), m_frame_no(0), m_stats_tick(0) {}
+	virtual ~the_app() { delete m_dyn_res; }
+
+	// every frame goes to sink too, as fast as it can be rendered
+	void set_sink( frame_sink * sink, int frames ) {
+		m_sink = sink;
+		m_frames = frames;
+	}
+
+	void set_seed( uint64_t seed ) { m_seed = seed; }
+	void set_spots( size_t count ) { m_spot_count = count; }
 
 	void on_create() {
 		m_background = new uint32_t [m_w * m_h];
+		m_frame = new uint32_t [m_w * m_h];
 
 		// generate background
-		float half_diag = sqrt( (m_w / 2) * (m_w / 2) + (m_h / 2) * (m_h / 2) );
-		for ( int y = 0; y < m_h; y++ ) {
-			for ( int x = 0; x < m_w; x++ ) {
-				float dx = x - m_w / 2;
-				float dy = y - m_h / 2;
-				float d = sqrt( dx * dx + dy * dy );
-
-				uint32_t a = 0x0000ff;
-				uint32_t b = MAKE_COLOR( 100, 190, 250, 0 );
-				m_background[m_w * y + x] = lerp_color( &a, &b, d / half_diag * 255 );
-			}
-		}
+		m_render_w = m_w;
+		m_render_h = m_h;
+		make_background( m_background, m_w, m_w, m_h );
+
+		m_spots = new spot_system( m_spot_count, m_w, m_h, 50, max_blur_radius, m_seed );
 
-		for ( size_t i = 0; i < 64; i++ ) {
-			std::uniform_int_distribution <int> fdist( 1, 10 );
-			m_spots.push_back( new live_spot( m_w, m_h, 50, fdist( rng )/*, 10*/ ) );
+		// quantize blur radii into layers, each layer blurs with the middle radius of its range
+		for ( int i = 0; i < m_dof_layers; i++ ) {
+			int r = 1 + (2 * i + 1) * max_blur_radius / (2 * m_dof_layers);
+			m_layers.push_back( depth_layer( m_w, m_h, r ) );
 		}
 	}
 
 	void on_destroy() {
-		for ( auto & i : m_spots ) {
-			delete i;
+		delete m_spots;
+		for ( auto & l : m_layers ) {
+			delete [] l.m_alpha.ptr();
 		}
 		delete [] m_background;
+		delete [] m_frame;
 	}
 
 	bool on_idle() {
-		memcpy( m_ptr, m_background, m_w * m_h * 4 );
+		auto t0 = std::chrono::high_resolution_clock::now();
+
+		int w = m_render_w, h = m_render_h;
+		float s = (float)w / m_w;
+		uint32_t *frame = w == m_w ? m_ptr : m_frame;
+		memcpy( frame, m_background, m_w * h * 4 );
+
+		m_spots->update( m_frame_no );
+		const uint32_t *visible = m_spots->visible();
+		int n = m_spots->visible_count();
+
+		if ( m_dof_layers ) {
+			// layers are independent: each one draws its spots (always in the same
+			// order, so the result doesn't depend on threads) and collects its regions
+			#pragma omp parallel for schedule(dynamic)
+			for ( int li = 0; li < m_dof_layers; li++ ) {
+				depth_layer & l = m_layers[li];
+				image <uint8_t> layer( l.m_alpha.ptr(), w, h, l.m_alpha.stride() );
+				int r = scaled_radius( l.m_blur_radius, s );
+				disc_raster8 raster;
+				for ( int k = 0; k < n; k++ ) {
+					uint32_t i = visible[k];
+					if ( layer_of( m_spots->blur_radius( i ) ) != li ) continue;
+					rect rc;
+					if ( raster.render( layer, m_spots->x( i ) * s, m_spots->y( i ) * s, m_spots->r( i ) * s, m_spots->a( i ), rc ) ) {
+						expand_bounds( rc, r, w, h );
+						l.add_region( rc );
+					}
+				}
+			}
+
+			// regions of all layers are blurred together, a layer with most of the spots
+			// doesn't keep the other threads waiting
+			m_blur_regions.clear();
+			for ( auto & l : m_layers ) {
+				int r = scaled_radius( l.m_blur_radius, s );
+				for ( auto & rc : l.m_regions ) {
+					image <uint8_t> subimg( l.m_alpha.pix_ptr( rc.x0, rc.y0 ), rc.x1 - rc.x0, rc.y1 - rc.y0, l.m_alpha.stride() );
+					m_blur_regions.push_back( stack_blur8::region( subimg, r, r ) );
+				}
+			}
+			stack_blur8::process_batch( m_blur_regions );
+
+			// composite back to front: the most blurred layer goes under the sharper ones
+			for ( int li = m_dof_layers - 1; li >= 0; li-- ) {
+				depth_layer & l = m_layers[li];
+				for ( auto & rc : l.m_regions ) {
+					blit_alpha( frame, m_w, l.m_alpha, rc, 256 );
+				}
+				l.m_regions.clear();
+			}
+		} else {
+			// lay out the masks, draw them in parallel and blur them in one batch
+			m_mask_rc.resize( n );
+			m_mask_offset.resize( n + 1 );
+			m_mask_offset[0] = 0;
+			for ( int k = 0; k < n; k++ ) {
+				uint32_t i = visible[k];
+				rect & rc = m_mask_rc[k];
+				if ( !spot_bounds( m_spots->x( i ) * s, m_spots->y( i ) * s, m_spots->r( i ) * s, scaled_radius( m_spots->blur_radius( i ), s ), w, h, rc ) ) {
+					rc.x1 = rc.x0; // empty, off the (scaled) screen
+					rc.y1 = rc.y0;
+				}
+				m_mask_offset[k + 1] = m_mask_offset[k] + (size_t)(rc.x1 - rc.x0) * (rc.y1 - rc.y0);
+			}
+			m_mask_pool.assign( m_mask_offset[n], 0 );
+
+			#pragma omp parallel for schedule(dynamic)
+			for ( int k = 0; k < n; k++ ) {
+				uint32_t i = visible[k];
+				const rect & rc = m_mask_rc[k];
+				if ( rc.x0 == rc.x1 ) continue;
+				image <uint8_t> mask( &m_mask_pool[m_mask_offset[k]], rc.x1 - rc.x0, rc.y1 - rc.y0, rc.x1 - rc.x0 );
+				disc_raster8 raster;
+				rect drc;
+				raster.render( mask, m_spots->x( i ) * s - rc.x0, m_spots->y( i ) * s - rc.y0, m_spots->r( i ) * s, 255, drc );
+			}
+
+			m_blur_regions.clear();
+			for ( int k = 0; k < n; k++ ) {
+				const rect & rc = m_mask_rc[k];
+				if ( rc.x0 == rc.x1 ) continue;
+				image <uint8_t> mask( &m_mask_pool[m_mask_offset[k]], rc.x1 - rc.x0, rc.y1 - rc.y0, rc.x1 - rc.x0 );
+				int r = scaled_radius( m_spots->blur_radius( visible[k] ), s );
+				m_blur_regions.push_back( stack_blur8::region( mask, r, r ) );
+			}
+			stack_blur8::process_batch( m_blur_regions );
+
+			// blit in one thread, in spot order
+			for ( int k = 0; k < n; k++ ) {
+				const rect & rc = m_mask_rc[k];
+				if ( rc.x0 == rc.x1 ) continue;
+				image <uint8_t> mask( &m_mask_pool[m_mask_offset[k]], rc.x1 - rc.x0, rc.y1 - rc.y0, rc.x1 - rc.x0 );
+				rect all = { 0, 0, mask.width(), mask.height() };
+				blit_alpha( frame + rc.y0 * m_w + rc.x0, m_w, mask, all, m_spots->a( visible[k] ) );
+			}
+		}
+
+		// the upscale costs the same at every scale, the controller gets it apart
+		auto t1 = std::chrono::high_resolution_clock::now();
+		if ( frame != m_ptr ) {
+			image <uint32_t> src( m_frame, w, h, m_w );
+			image <uint32_t> dst( m_ptr, m_w, m_h, m_w );
+			m_upscale.process( src, dst );
+		}
 
-		//#pragma omp parallel for
-		for ( size_t i = 0; i < m_spots.size(); i++ ) { // OpenMP work only with ints, i.e. with indices
-			m_spots[i]->lifecycle();
-			m_spots[i]->render( m_w, m_h );
+		if ( m_dyn_res ) {
+			auto t2 = std::chrono::high_resolution_clock::now();
+			double render_ms = std::chrono::duration <double, std::milli>( t1 - t0 ).count();
+			double fixed_ms = std::chrono::duration <double, std::milli>( t2 - t1 ).count();
+			float ns = m_dyn_res->update( render_ms, fixed_ms );
+			int nw = (int)(m_w * ns + .5f), nh = (int)(m_h * ns + .5f);
+			if ( nw != m_render_w || nh != m_render_h ) {
+				m_render_w = nw;
+				m_render_h = nh;
+				make_background( m_background, m_w, nw, nh );
+			}
 		}
 
-		// blit in one thread
-		for ( auto & i : m_spots ) {
-			i->blit( m_ptr, m_w, m_h );
+		m_frame_no++;
+		report_stats();
+
+		if ( m_sink ) {
+			if ( m_sink->failed() ) return false; // no point rendering what can't be written
+			m_sink->write( m_ptr );
+			swap();
+			return !m_frames || --m_frames > 0;
 		}
 
-		update();
+		swap(); // the next frame starts from the background again
 		Sleep( 20 );
 		return true; // continue
 	}
@@ -276,9 +399,35 @@ static the_app * app;
 
 int APIENTRY WinMain( HINSTANCE hInst, HINSTANCE hPInst, LPSTR lpCmdLine, int nCmdShow )
 {
-	rng.seed( std::chrono::system_clock::to_time_t( std::chrono::high_resolution_clock::now() ) );
-	app = new the_app( -1, -1, 1280, 720 );
+	// spots.exe [-o file|- [-raw] [-frames n]] [-seed n] [-spots n]
+	const char *out = NULL;
+	bool raw = false;
+	int frames = 0, spots = 0;
+	uint64_t seed = std::chrono::system_clock::to_time_t( std::chrono::high_resolution_clock::now() );
+	for ( char *arg = strtok( lpCmdLine, " " ); arg; arg = strtok( NULL, " " ) ) {
+		if ( !strcmp( arg, "-o" ) ) out = strtok( NULL, " " );
+		else if ( !strcmp( arg, "-raw" ) ) raw = true;
+		else if ( !strcmp( arg, "-frames" ) && (arg = strtok( NULL, " " )) ) frames = atoi( arg );
+		else if ( !strcmp( arg, "-seed" ) && (arg = strtok( NULL, " " )) ) seed = strtoull( arg, NULL, 10 );
+		else if ( !strcmp( arg, "-spots" ) && (arg = strtok( NULL, " " )) ) spots = atoi( arg );
+	}
+
+	app = new the_app( -1, -1, 1280, 720, 1, 10 /* depth layers */, out ? 0 : 10 /* ms per frame */ );
+	app->set_seed( seed );
+	if ( spots > 0 ) app->set_spots( spots );
+
+	FILE *f = out ? frame_sink::open( out ) : NULL;
+	frame_sink *sink = f ? new frame_sink( f, 1280, 720, 50, raw ? frame_sink::raw_rgba : frame_sink::y4m ) : NULL;
+	app->set_sink( sink, frames );
+
 	app->idle( true /* call on_idle() ? */ );
+	int res = 0;
+	if ( sink && !sink->finish() ) {
+		fprintf( stderr, "spots: writing %s failed, the output is incomplete\n", out );
+		res = 1;
+	}
+	delete sink;
+	if ( f && f != stdout ) fclose( f );
 	delete app;
-	return 0;
+	return res;
 }
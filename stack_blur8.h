@@ -14,6 +14,13 @@
 //
 // Stack Blur algorithm implementation. Thanks to Mario Klingemann - the author.
 //
+// The stack lives in the object (sized for the largest radius), so process()
+// never allocates; process_batch() blurs many small regions, e.g. the spots of
+// a frame, with one blur object per thread.
+//
+// Radii up to 32 (spots uses 1 - 10) go to kernels compiled for the radius,
+// the rest to the generic passes; the output is the same either way.
+//
 //----------------------------------------------------------------------------
 
 #ifndef	__STACK_BLUR8_H__
@@ -56,10 +63,20 @@ static uint8_t const g_stack_blur8_shr[255] = {
 	24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24 };
 
 class stack_blur8 {
+	enum { max_radius = 254, max_fast_radius = 32, lanes = 16 };
 
-public:
-	void process( image <uint8_t> & img, unsigned rx, unsigned ry ) {
-		unsigned x, y, xp, yp, i;
+	typedef void (*pass_fn)( image <uint8_t> & img );
+
+	uint8_t	m_stack[max_radius * 2 + 1];
+
+	// a power of two above r * 2 + 1, the ring of the fast kernels is indexed with a mask
+	static constexpr unsigned ring_size( unsigned r, unsigned n = 2 ) {
+		return n > r * 2 + 1 ? n : ring_size( r, n * 2 );
+	}
+
+	// horizontal pass of any radius
+	void rows( image <uint8_t> & img, unsigned r ) {
+		unsigned x, y, xp, i;
 		unsigned stack_ptr;
 		unsigned stack_start;
 		const uint8_t * src_pix_ptr;
@@ -72,123 +89,300 @@ public:
 		unsigned w   = img.width();
 		unsigned h   = img.height();
 		unsigned wm  = w - 1;
-		unsigned hm  = h - 1;
 		unsigned div;
 		unsigned mul_sum;
 		unsigned shr_sum;
 
-		uint8_t * stack;
+		uint8_t * stack = m_stack;
+
+		div = r * 2 + 1;
+		mul_sum = g_stack_blur8_mul[r];
+		shr_sum = g_stack_blur8_shr[r];
 
-		if ( rx > 0 ) {
-			if ( rx > 254 ) rx = 254;
+		for ( y = 0; y < h; y++ ) {
+			sum = sum_in = sum_out = 0;
+			src_pix_ptr = img.pix_ptr(0, y);
+			pix = *src_pix_ptr;
+			for ( i = 0; i <= r; i++ ) {
+				stack[i] = pix;
+				sum     += pix * (i + 1);
+				sum_out += pix;
+			}
+			for ( i = 1; i <= r; i++ ) {
+				if ( i <= wm ) src_pix_ptr++;
+				pix = *src_pix_ptr; 
+				stack[i + r] = pix;
+				sum    += pix * (r + 1 - i);
+				sum_in += pix;
+			}
+			stack_ptr = r;
+			xp = r;
+			if ( xp > wm ) xp = wm;
+			src_pix_ptr = img.pix_ptr( xp, y );
+			dst_pix_ptr = img.pix_ptr(  0, y );
+			for ( x = 0; x < w; x++ ) {
+				*dst_pix_ptr = (sum * mul_sum) >> shr_sum;
+				dst_pix_ptr++;
+				sum -= sum_out;
+				stack_start = stack_ptr + div - r;
+				if ( stack_start >= div ) stack_start -= div;
+				sum_out -= stack[stack_start];
+				if ( xp < wm ) {
+					src_pix_ptr++;
+					pix = *src_pix_ptr;
+					++xp;
+				}
+				stack[stack_start] = pix;
+				sum_in += pix;
+				sum    += sum_in;
+				++stack_ptr;
+				if ( stack_ptr >= div ) stack_ptr = 0;
+				stack_pix = stack[stack_ptr];
+				sum_out += stack_pix;
+				sum_in  -= stack_pix;
+			}
+		}
+	}
+
+	// vertical pass of any radius
+	void columns( image <uint8_t> & img, unsigned r ) {
+		unsigned x, y, yp, i;
+		unsigned stack_ptr;
+		unsigned stack_start;
+		const uint8_t * src_pix_ptr;
+		uint8_t * dst_pix_ptr;
+		unsigned pix;
+		unsigned stack_pix;
+		unsigned sum;
+		unsigned sum_in;
+		unsigned sum_out;
+		unsigned w   = img.width();
+		unsigned h   = img.height();
+		unsigned hm  = h - 1;
+		unsigned div;
+		unsigned mul_sum;
+		unsigned shr_sum;
 
-			div = rx * 2 + 1;
-			mul_sum = g_stack_blur8_mul[rx];
-			shr_sum = g_stack_blur8_shr[rx];
+		uint8_t * stack = m_stack;
 
-			stack = new uint8_t [div];
+		div = r * 2 + 1;
+		mul_sum = g_stack_blur8_mul[r];
+		shr_sum = g_stack_blur8_shr[r];
 
+		int stride = img.stride();
+		for ( x = 0; x < w; x++ ) {
+			sum = sum_in = sum_out = 0;
+			src_pix_ptr = img.pix_ptr( x, 0 );
+			pix = *src_pix_ptr;
+			for ( i = 0; i <= r; i++ ) {
+				stack[i] = pix;
+				sum     += pix * (i + 1);
+				sum_out += pix;
+			}
+			for ( i = 1; i <= r; i++ ) {
+				if ( i <= hm ) src_pix_ptr += stride; 
+				pix = *src_pix_ptr; 
+				stack[i + r] = pix;
+				sum    += pix * (r + 1 - i);
+				sum_in += pix;
+			}
+			stack_ptr = r;
+			yp = r;
+			if ( yp > hm ) yp = hm;
+			src_pix_ptr = img.pix_ptr( x, yp );
+			dst_pix_ptr = img.pix_ptr( x,  0 );
 			for ( y = 0; y < h; y++ ) {
-				sum = sum_in = sum_out = 0;
-				src_pix_ptr = img.pix_ptr(0, y);
-				pix = *src_pix_ptr;
-				for ( i = 0; i <= rx; i++ ) {
-					stack[i] = pix;
-					sum     += pix * (i + 1);
-					sum_out += pix;
-				}
-				for ( i = 1; i <= rx; i++ ) {
-					if ( i <= wm ) src_pix_ptr++;
-					pix = *src_pix_ptr; 
-					stack[i + rx] = pix;
-					sum    += pix * (rx + 1 - i);
-					sum_in += pix;
-				}
-				stack_ptr = rx;
-				xp = rx;
-				if ( xp > wm ) xp = wm;
-				src_pix_ptr = img.pix_ptr( xp, y );
-				dst_pix_ptr = img.pix_ptr(  0, y );
-				for ( x = 0; x < w; x++ ) {
-					*dst_pix_ptr = (sum * mul_sum) >> shr_sum;
-					dst_pix_ptr++;
-					sum -= sum_out;
-					stack_start = stack_ptr + div - rx;
-					if ( stack_start >= div ) stack_start -= div;
-					sum_out -= stack[stack_start];
-					if ( xp < wm ) {
-						src_pix_ptr++;
-						pix = *src_pix_ptr;
-						++xp;
-					}
-					stack[stack_start] = pix;
-					sum_in += pix;
-					sum    += sum_in;
-					++stack_ptr;
-					if ( stack_ptr >= div ) stack_ptr = 0;
-					stack_pix = stack[stack_ptr];
-					sum_out += stack_pix;
-					sum_in  -= stack_pix;
+				*dst_pix_ptr = (sum * mul_sum) >> shr_sum;
+				dst_pix_ptr += stride;
+				sum -= sum_out;
+				stack_start = stack_ptr + div - r;
+				if ( stack_start >= div ) stack_start -= div;
+				sum_out -= stack[stack_start];
+				if ( yp < hm ) {
+					src_pix_ptr += stride;
+					pix = *src_pix_ptr;
+					++yp;
 				}
+				stack[stack_start] = pix;
+				sum_in += pix;
+				sum    += sum_in;
+				++stack_ptr;
+				if ( stack_ptr >= div ) stack_ptr = 0;
+				stack_pix = stack[stack_ptr];
+				sum_out += stack_pix;
+				sum_in  -= stack_pix;
+			}
+		}
+	}
+
+	// Fast kernels for radius R: the sums are the same as in rows() and columns(), so
+	// is the result, but the ring, multiplier and shift are known at compile time and
+	// up to 16 lines are blurred side by side, which the compiler turns into SIMD.
+
+	// rows [y0, y0 + n) at once, pixel by pixel
+	template <unsigned R> static void rows_block( image <uint8_t> & img, unsigned y0, unsigned n ) {
+		enum { div = R * 2 + 1, mask = ring_size( R ) - 1 };
+		const unsigned mul_sum = g_stack_blur8_mul[R];
+		const unsigned shr_sum = g_stack_blur8_shr[R];
+		uint8_t stack[mask + 1][lanes];		// pixel x of the rows is at [(x + R) & mask]
+		uint8_t edge[lanes];
+		unsigned sum[lanes], sum_in[lanes], sum_out[lanes];
+		unsigned w  = img.width();
+		unsigned wm = w - 1;
+		int stride  = img.stride();
+		uint8_t * src = img.row_ptr( y0 );
+		unsigned c;
+
+		for ( c = 0; c < n; c++ ) {
+			edge[c]    = src[c * stride];
+			sum[c]     = edge[c] * ((R + 1) * (R + 2) / 2);
+			sum_out[c] = edge[c] * (R + 1);
+			sum_in[c]  = 0;
+		}
+		for ( unsigned i = 0; i <= R; i++ ) memcpy( stack[i], edge, n );
+		for ( unsigned i = 1; i <= R; i++ ) {
+			unsigned xp = i <= wm ? i : wm;
+			for ( c = 0; c < n; c++ ) {
+				unsigned pix = src[c * stride + xp];
+				stack[i + R][c] = pix;
+				sum[c]    += pix * (R + 1 - i);
+				sum_in[c] += pix;
 			}
-			delete [] stack;
 		}
+		for ( c = 0; c < n; c++ ) edge[c] = src[c * stride + wm];
 
-		if ( ry > 0 ) {
-			if ( ry > 254 ) ry = 254;
-			div = ry * 2 + 1;
-			mul_sum = g_stack_blur8_mul[ry];
-			shr_sum = g_stack_blur8_shr[ry];
+		for ( unsigned x = 0; x < w; x++ ) {
+			const uint8_t * out = stack[x & mask];
+			uint8_t * in = stack[(x + div) & mask];
+			const uint8_t * mid = stack[(x + R + 1) & mask];
+			if ( x + R + 1 <= wm ) {
+				for ( c = 0; c < n; c++ ) in[c] = src[c * stride + x + R + 1];
+			} else {
+				memcpy( in, edge, n );
+			}
+			for ( c = 0; c < n; c++ ) {
+				src[c * stride + x] = (sum[c] * mul_sum) >> shr_sum;
+				sum[c]     -= sum_out[c];
+				sum_out[c] -= out[c];
+				sum_in[c]  += in[c];
+				sum[c]     += sum_in[c];
+				sum_out[c] += mid[c];
+				sum_in[c]  -= mid[c];
+			}
+		}
+	}
 
-			stack = new uint8_t [div];
+	// columns [x0, x0 + n) at once, row by row
+	template <unsigned R> static void columns_block( image <uint8_t> & img, unsigned x0, unsigned n ) {
+		enum { div = R * 2 + 1, mask = ring_size( R ) - 1 };
+		const unsigned mul_sum = g_stack_blur8_mul[R];
+		const unsigned shr_sum = g_stack_blur8_shr[R];
+		uint8_t stack[mask + 1][lanes];		// row y of the columns is at [(y + R) & mask]
+		unsigned sum[lanes], sum_in[lanes], sum_out[lanes];
+		unsigned h  = img.height();
+		unsigned hm = h - 1;
+		const uint8_t * top = img.pix_ptr( x0, 0 );
+		const uint8_t * bottom = img.pix_ptr( x0, hm );
+		unsigned c;
 
-			int stride = img.stride();
-			for ( x = 0; x < w; x++ ) {
-				sum = sum_in = sum_out = 0;
-				src_pix_ptr = img.pix_ptr( x, 0 );
-				pix = *src_pix_ptr;
-				for ( i = 0; i <= ry; i++ ) {
-					stack[i] = pix;
-					sum     += pix * (i + 1);
-					sum_out += pix;
-				}
-				for ( i = 1; i <= ry; i++ ) {
-					if ( i <= hm ) src_pix_ptr += stride; 
-					pix = *src_pix_ptr; 
-					stack[i + ry] = pix;
-					sum    += pix * (ry + 1 - i);
-					sum_in += pix;
-				}
-				stack_ptr = ry;
-				yp = ry;
-				if ( yp > hm ) yp = hm;
-				src_pix_ptr = img.pix_ptr( x, yp );
-				dst_pix_ptr = img.pix_ptr( x,  0 );
-				for ( y = 0; y < h; y++ ) {
-					*dst_pix_ptr = (sum * mul_sum) >> shr_sum;
-					dst_pix_ptr += stride;
-					sum -= sum_out;
-					stack_start = stack_ptr + div - ry;
-					if ( stack_start >= div ) stack_start -= div;
-					sum_out -= stack[stack_start];
-					if ( yp < hm ) {
-						src_pix_ptr += stride;
-						pix = *src_pix_ptr;
-						++yp;
-					}
-					stack[stack_start] = pix;
-					sum_in += pix;
-					sum    += sum_in;
-					++stack_ptr;
-					if ( stack_ptr >= div ) stack_ptr = 0;
-					stack_pix = stack[stack_ptr];
-					sum_out += stack_pix;
-					sum_in  -= stack_pix;
-				}
+		for ( c = 0; c < n; c++ ) {
+			sum[c]     = top[c] * ((R + 1) * (R + 2) / 2);
+			sum_out[c] = top[c] * (R + 1);
+			sum_in[c]  = 0;
+		}
+		for ( unsigned i = 0; i <= R; i++ ) memcpy( stack[i], top, n );
+		for ( unsigned i = 1; i <= R; i++ ) {
+			const uint8_t * src = i <= hm ? img.pix_ptr( x0, i ) : bottom;
+			memcpy( stack[i + R], src, n );
+			for ( c = 0; c < n; c++ ) {
+				sum[c]    += src[c] * (R + 1 - i);
+				sum_in[c] += src[c];
+			}
+		}
+
+		for ( unsigned y = 0; y < h; y++ ) {
+			uint8_t * dst = img.pix_ptr( x0, y );
+			const uint8_t * src = y + R + 1 <= hm ? img.pix_ptr( x0, y + R + 1 ) : bottom;
+			const uint8_t * out = stack[y & mask];
+			uint8_t * in = stack[(y + div) & mask];
+			const uint8_t * mid = stack[(y + R + 1) & mask];
+			memcpy( in, src, n );
+			for ( c = 0; c < n; c++ ) {
+				dst[c] = (sum[c] * mul_sum) >> shr_sum;
+				sum[c]     -= sum_out[c];
+				sum_out[c] -= out[c];
+				sum_in[c]  += in[c];
+				sum[c]     += sum_in[c];
+				sum_out[c] += mid[c];
+				sum_in[c]  -= mid[c];
+			}
+		}
+	}
+
+	template <unsigned R> static void fast_rows( image <uint8_t> & img ) {
+		for ( int y = 0; y < img.height(); y += lanes ) {
+			rows_block <R>( img, y, std::min( img.height() - y, (int)lanes ) );
+		}
+	}
+
+	template <unsigned R> static void fast_columns( image <uint8_t> & img ) {
+		for ( int x = 0; x < img.width(); x += lanes ) {
+			columns_block <R>( img, x, std::min( img.width() - x, (int)lanes ) );
+		}
+	}
+
+public:
+	// a sub-image to blur and its radii
+	struct region {
+		image <uint8_t>	m_img;
+		unsigned		m_rx, m_ry;
+
+		region( const image <uint8_t> & img, unsigned rx, unsigned ry ) : m_img(img), m_rx(rx), m_ry(ry) {}
+	};
+
+	void process( image <uint8_t> & img, unsigned rx, unsigned ry ) {
+		#define STACK_BLUR8_FAST( f )	NULL, \
+			f <1>,  f <2>,  f <3>,  f <4>,  f <5>,  f <6>,  f <7>,  f <8>, \
+			f <9>,  f <10>, f <11>, f <12>, f <13>, f <14>, f <15>, f <16>, \
+			f <17>, f <18>, f <19>, f <20>, f <21>, f <22>, f <23>, f <24>, \
+			f <25>, f <26>, f <27>, f <28>, f <29>, f <30>, f <31>, f <32>
+		static const pass_fn fast_h[max_fast_radius + 1] = { STACK_BLUR8_FAST( fast_rows ) };
+		static const pass_fn fast_v[max_fast_radius + 1] = { STACK_BLUR8_FAST( fast_columns ) };
+		#undef STACK_BLUR8_FAST
+
+		if ( !img.width() || !img.height() ) return;
+		if ( rx > max_radius ) rx = max_radius;
+		if ( ry > max_radius ) ry = max_radius;
+
+		if ( rx > max_fast_radius ) {
+			rows( img, rx );
+		} else if ( rx > 0 ) {
+			fast_h[rx]( img );
+		}
+		if ( ry > max_fast_radius ) {
+			columns( img, ry );
+		} else if ( ry > 0 ) {
+			fast_v[ry]( img );
+		}
+	}
+
+	// blurs all regions, which must not overlap, spread over the OpenMP threads with one
+	// blur object (one stack) a thread. The regions are sorted by address first, so the
+	// ones close in memory are blurred one after another; no allocation once the vector
+	// has its capacity.
+	static void process_batch( std::vector <region> & regions ) {
+		std::sort( regions.begin(), regions.end(),
+			[]( const region & a, const region & b ) { return std::less <const uint8_t *>()( a.m_img.ptr(), b.m_img.ptr() ); } );
+		int n = regions.size();
+		#pragma omp parallel if ( n > 1 )
+		{
+			stack_blur8 blur;
+			#pragma omp for schedule(dynamic, 2)
+			for ( int i = 0; i < n; i++ ) {
+				blur.process( regions[i].m_img, regions[i].m_rx, regions[i].m_ry );
 			}
 		}
-		delete [] stack;
 	}
 };
 
-#endif // __STACK_BLUR_H__
+#endif // __STACK_BLUR8_H__
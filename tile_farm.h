@@ -0,0 +1,324 @@
+//----------------------------------------------------------------------------
+// FX Project
+// Copyright (C) 2013 Anton Sazonov (lazybiz)
+//
+// Permission to copy, use, modify, sell and distribute this software 
+// is granted provided this copyright notice appears in all copies. 
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+// Contact: lazybiz@yandex.ru
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Tile farm: renders a frame with several worker processes. The frame is
+// cut into tiles which are handed to the workers over their stdin, one at
+// a time; finished tiles come back over their stdout and are copied into
+// the frame. A tile lost with a dead worker is queued again, and once the
+// queue is empty idle workers take over tiles which run much longer than
+// the average (the first copy to finish wins). Idle workers sleep on an
+// event until there's a tile for them or the frame is done. If the workers
+// die before the frame is done, unfinished() lists the tiles left for the
+// caller.
+//
+// Worker side is serve(): the same executable started with the command
+// line given to the farm, reading requests until stdin is closed.
+//
+//----------------------------------------------------------------------------
+
+#ifndef __TILE_FARM_H__
+#define __TILE_FARM_H__
+
+class tile_farm {
+public:
+	struct tile {
+		int32_t	x0, y0, x1, y1;	// x0 < 0 - quit
+		int32_t	w, h;			// frame size
+	};
+
+	typedef std::function <void ( const tile &, uint8_t * )> render_fn;
+
+private:
+	enum { tile_pending, tile_running, tile_done };
+
+	struct job {
+		tile	m_rc;
+		int		m_state;
+		int		m_copies;	// workers rendering it now
+		DWORD	m_start;	// tick of the latest dispatch
+	};
+
+	struct worker {
+		tile_farm *	m_farm;
+		HANDLE		m_process;
+		HANDLE		m_in;		// requests, worker's stdin
+		HANDLE		m_out;		// results, worker's stdout
+		HANDLE		m_thread;
+		bool		m_dead;		// failed once, not used any more
+	};
+
+	CRITICAL_SECTION		m_lock;
+	HANDLE					m_wake;			// manual reset, set when an idle worker may find a tile
+	std::vector <job>		m_jobs;
+	std::vector <int>		m_finished;		// jobs done since the last progress() calls
+	std::vector <worker>	m_workers;
+	uint8_t *				m_dst;
+	size_t					m_pitch;		// bytes
+	size_t					m_pixel_size;
+	unsigned				m_done;
+	unsigned				m_alive;		// worker threads still running
+	DWORD					m_total_ms;		// of finished tiles, for the straggler test
+
+	static bool read_all( HANDLE h, void * p, size_t n ) {
+		for ( DWORD got; n; n -= got, p = (uint8_t *)p + got ) {
+			if ( !ReadFile( h, p, n, &got, NULL ) || !got ) return false;
+		}
+		return true;
+	}
+
+	static bool write_all( HANDLE h, const void * p, size_t n ) {
+		for ( DWORD put; n; n -= put, p = (const uint8_t *)p + put ) {
+			if ( !WriteFile( h, p, n, &put, NULL ) || !put ) return false;
+		}
+		return true;
+	}
+
+	static size_t tile_bytes( const tile & t, size_t pixel_size ) {
+		return (size_t)(t.x1 - t.x0) * (t.y1 - t.y0) * pixel_size;
+	}
+
+	// a pending tile, else a straggler, -1 if there's neither; called under the lock
+	int pick( DWORD now ) const {
+		DWORD slow = m_done ? 2 * m_total_ms / m_done + 100 : INFINITE;
+		for ( size_t i = 0; i < m_jobs.size(); i++ ) {
+			if ( m_jobs[i].m_state == tile_pending ) return i;
+		}
+		for ( size_t i = 0; i < m_jobs.size(); i++ ) {
+			const job & b = m_jobs[i];
+			if ( b.m_state == tile_running && b.m_copies == 1 && now - b.m_start > slow ) return i;
+		}
+		return -1;
+	}
+
+	// next tile for a worker, -1 when the frame is done; with nothing to take it waits for
+	// finish() or the straggler check in render() to set m_wake
+	int next_job() {
+		for ( ; ; ) {
+			EnterCriticalSection( &m_lock );
+			if ( m_done == m_jobs.size() ) {
+				LeaveCriticalSection( &m_lock );
+				return -1;
+			}
+			DWORD now = GetTickCount();
+			int j = pick( now );
+			if ( j >= 0 ) {
+				if ( m_jobs[j].m_state == tile_pending ) m_jobs[j].m_start = now;
+				m_jobs[j].m_state = tile_running;
+				m_jobs[j].m_copies++;
+			} else {
+				ResetEvent( m_wake );	// under the lock, so a change made after this sets it again
+			}
+			LeaveCriticalSection( &m_lock );
+			if ( j >= 0 ) return j;
+			WaitForSingleObject( m_wake, INFINITE );
+		}
+	}
+
+	// pixels == NULL - the worker failed, the tile goes back to the queue
+	void finish( int j, const uint8_t * pixels ) {
+		EnterCriticalSection( &m_lock );
+		job & b = m_jobs[j];
+		b.m_copies--;
+		if ( b.m_state != tile_done ) {
+			if ( pixels ) {
+				const tile & t = b.m_rc;
+				size_t row = (t.x1 - t.x0) * m_pixel_size;
+				for ( int y = t.y0; y < t.y1; y++, pixels += row ) {
+					memcpy( m_dst + y * m_pitch + t.x0 * m_pixel_size, pixels, row );
+				}
+				b.m_state = tile_done;
+				m_done++;
+				m_total_ms += GetTickCount() - b.m_start;
+				m_finished.push_back( j );
+			} else if ( !b.m_copies ) {
+				b.m_state = tile_pending;
+			}
+		}
+		SetEvent( m_wake );
+		LeaveCriticalSection( &m_lock );
+	}
+
+	static DWORD WINAPI worker_proc( LPVOID param ) {
+		worker *w = (worker *)param;
+		tile_farm *f = w->m_farm;
+		std::vector <uint8_t> pixels;
+		for ( int j; (j = f->next_job()) >= 0; ) {
+			tile t = f->m_jobs[j].m_rc, r;
+			pixels.resize( tile_bytes( t, f->m_pixel_size ) );
+			bool ok = write_all( w->m_in, &t, sizeof( t ) )
+				&& read_all( w->m_out, &r, sizeof( r ) ) && !memcmp( &r, &t, sizeof( t ) )
+				&& read_all( w->m_out, &pixels[0], pixels.size() );
+			f->finish( j, ok ? &pixels[0] : NULL );
+			if ( !ok ) {
+				w->m_dead = true; // dead or confused, leave it to the others
+				break;
+			}
+		}
+
+		EnterCriticalSection( &f->m_lock );
+		f->m_alive--;
+		LeaveCriticalSection( &f->m_lock );
+		return 0;
+	}
+
+	bool spawn( const char * cmd_line, worker & w ) {
+		SECURITY_ATTRIBUTES sa = { sizeof( SECURITY_ATTRIBUTES ), NULL, TRUE };
+		HANDLE child_in, child_out;
+		if ( !CreatePipe( &child_in, &w.m_in, &sa, 0 ) ) return false;
+		if ( !CreatePipe( &w.m_out, &child_out, &sa, 0 ) ) {
+			CloseHandle( child_in );
+			CloseHandle( w.m_in );
+			return false;
+		}
+		SetHandleInformation( w.m_in, HANDLE_FLAG_INHERIT, 0 );
+		SetHandleInformation( w.m_out, HANDLE_FLAG_INHERIT, 0 );
+
+		STARTUPINFO si = {};
+		si.cb = sizeof( si );
+		si.dwFlags = STARTF_USESTDHANDLES;
+		si.hStdInput = child_in;
+		si.hStdOutput = child_out;
+		si.hStdError = GetStdHandle( STD_ERROR_HANDLE );
+
+		PROCESS_INFORMATION pi;
+		std::vector <char> cmd( cmd_line, cmd_line + strlen( cmd_line ) + 1 );
+		bool ok = CreateProcess( NULL, &cmd[0], NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi );
+		CloseHandle( child_in );
+		CloseHandle( child_out );
+		if ( !ok ) {
+			CloseHandle( w.m_in );
+			CloseHandle( w.m_out );
+			return false;
+		}
+		CloseHandle( pi.hThread );
+		w.m_process = pi.hProcess;
+		return true;
+	}
+
+public:
+	// cmd_line starts a worker
+	tile_farm( const char * cmd_line, unsigned workers ) {
+		InitializeCriticalSection( &m_lock );
+		m_wake = CreateEvent( NULL, TRUE, FALSE, NULL );
+		for ( unsigned i = 0; i < workers; i++ ) {
+			worker w = {};
+			w.m_farm = this;
+			if ( spawn( cmd_line, w ) ) m_workers.push_back( w );
+		}
+	}
+
+	~tile_farm() {
+		tile quit = { -1, -1, -1, -1, 0, 0 };
+		for ( auto & w : m_workers ) {
+			write_all( w.m_in, &quit, sizeof( quit ) );
+			CloseHandle( w.m_in );
+			if ( WaitForSingleObject( w.m_process, 1000 ) == WAIT_TIMEOUT ) TerminateProcess( w.m_process, 1 );
+			CloseHandle( w.m_out );
+			CloseHandle( w.m_process );
+		}
+		CloseHandle( m_wake );
+		DeleteCriticalSection( &m_lock );
+	}
+
+	// workers still usable
+	unsigned workers() const {
+		unsigned n = 0;
+		for ( auto & w : m_workers ) n += !w.m_dead;
+		return n;
+	}
+
+	// renders the w x h frame at dst (pitch in bytes) in tiles of tile_size pixels,
+	// progress( t ) is called on this thread for every tile t once it is in the frame
+	// (a finished tile isn't written again, so it can be read without the lock);
+	// false if the workers died
+	bool render( void * dst, size_t pitch, int w, int h, size_t pixel_size, int tile_size, const std::function <void ( const tile & )> & progress ) {
+		m_dst = (uint8_t *)dst;
+		m_pitch = pitch;
+		m_pixel_size = pixel_size;
+		m_done = 0;
+		m_total_ms = 0;
+		m_jobs.clear();
+		m_finished.clear();
+		ResetEvent( m_wake );
+		for ( int y = 0; y < h; y += tile_size ) {
+			for ( int x = 0; x < w; x += tile_size ) {
+				job b = { { x, y, std::min( x + tile_size, w ), std::min( y + tile_size, h ), w, h }, tile_pending, 0, 0 };
+				m_jobs.push_back( b );
+			}
+		}
+
+		// counted as they start, under the lock, so a thread which fails to start isn't waited for
+		EnterCriticalSection( &m_lock );
+		m_alive = 0;
+		for ( auto & wk : m_workers ) {
+			wk.m_thread = wk.m_dead ? NULL : CreateThread( NULL, 0, worker_proc, &wk, 0, NULL );
+			if ( wk.m_thread ) {
+				m_alive++;
+			} else {
+				wk.m_dead = true;
+			}
+		}
+		LeaveCriticalSection( &m_lock );
+
+		std::vector <int> finished;
+		for ( ; ; ) {
+			EnterCriticalSection( &m_lock );
+			bool over = m_done == m_jobs.size() || !m_alive;
+			finished.swap( m_finished );
+			// a tile has become a straggler since the last look, wake an idle worker for it
+			if ( !over && pick( GetTickCount() ) >= 0 ) SetEvent( m_wake );
+			LeaveCriticalSection( &m_lock );
+			for ( int j : finished ) progress( m_jobs[j].m_rc );
+			finished.clear();
+			if ( over ) break;
+			Sleep( 20 );
+		}
+
+		for ( auto & wk : m_workers ) {
+			if ( !wk.m_thread ) continue;
+			// a hung worker still holds its thread in a read, unblock it
+			if ( WaitForSingleObject( wk.m_thread, 1000 ) == WAIT_TIMEOUT ) {
+				TerminateProcess( wk.m_process, 1 );
+				WaitForSingleObject( wk.m_thread, INFINITE );
+				wk.m_dead = true;
+			}
+			CloseHandle( wk.m_thread );
+		}
+		return m_done == m_jobs.size();
+	}
+
+	// tiles the last render() didn't get back, for the caller to render itself
+	std::vector <tile> unfinished() const {
+		std::vector <tile> left;
+		for ( auto & b : m_jobs ) {
+			if ( b.m_state != tile_done ) left.push_back( b.m_rc );
+		}
+		return left;
+	}
+
+	// worker side: renders requested tiles of pixel_size bytes per pixel until told to quit
+	static void serve( size_t pixel_size, const render_fn & render ) {
+		HANDLE in = GetStdHandle( STD_INPUT_HANDLE );
+		HANDLE out = GetStdHandle( STD_OUTPUT_HANDLE );
+		std::vector <uint8_t> pixels;
+		tile t;
+		while ( read_all( in, &t, sizeof( t ) ) && t.x0 >= 0 ) {
+			pixels.resize( tile_bytes( t, pixel_size ) );
+			render( t, &pixels[0] );
+			if ( !write_all( out, &t, sizeof( t ) ) || !write_all( out, &pixels[0], pixels.size() ) ) break;
+		}
+	}
+};
+
+#endif // __TILE_FARM_H__
@@ -15,11 +15,79 @@
 
 static const char *	class_name = "x_window_cls_x86";
 
+struct frame_stats {
+	unsigned	rendered;	// frames handed over by update() / swap()
+	unsigned	presented;	// frames which reached the screen
+	unsigned	dropped;	// frames replaced by a newer one before being presented
+	unsigned	repeated;	// refresh intervals which passed without a new frame
+};
+
 class window {
 	static int	m_ref_count;
 	HWND		m_wnd;
 	BITMAPINFO	m_bi;
 
+	//
+	// asynchronous present: a swap chain of three buffers (back, ready, front) and a present
+	// thread. The render thread owns back, the present thread owns front, ready is exchanged
+	// atomically by both, so neither side ever waits for the other.
+	//
+	enum { fresh_frame = 4 };	// set in m_ready while the frame there is not presented yet
+
+	bool					m_async;
+	uint32_t *				m_chain[3];
+	unsigned				m_back, m_front;
+	std::atomic <unsigned>	m_ready;	// index | fresh_frame
+	std::atomic <bool>		m_quit;
+	HANDLE					m_present_event;
+	HANDLE					m_present_thread;
+	DWORD					m_refresh_ms;
+	DWORD					m_publish_tick;	// GetTickCount() of the latest frame handed over
+
+	std::atomic <unsigned>	m_rendered, m_presented, m_dropped, m_repeated;
+
+	void paint( HDC dc, const uint32_t * p ) {
+		if ( m_scale == 1 ) {
+			SetDIBitsToDevice( dc, 0, 0, m_w, m_h, 0, 0, 0, m_h, p, &m_bi, DIB_RGB_COLORS );
+		} else {
+			StretchDIBits( dc, 0, 0, m_w * m_scale, m_h * m_scale, 0, 0, m_w, m_h, p, &m_bi, DIB_RGB_COLORS, SRCCOPY );
+		}
+	}
+
+	// latest complete frame goes to the screen, repaint requests show the front buffer again
+	static DWORD WINAPI present_proc( LPVOID param ) {
+		window *p = (window *)param;
+		bool has_frame = false;
+		while ( !p->m_quit ) {
+			DWORD res = WaitForSingleObject( p->m_present_event, p->m_refresh_ms );
+			if ( p->m_quit ) break;
+			if ( p->m_ready & fresh_frame ) {
+				p->m_front = p->m_ready.exchange( p->m_front ) & ~fresh_frame;
+				has_frame = true;
+				p->m_presented++;
+			} else if ( res == WAIT_TIMEOUT ) {
+				if ( has_frame ) p->m_repeated++;
+				continue;
+			}
+			if ( !has_frame ) continue; // a repaint before the first frame, front holds garbage
+			HDC dc = GetDC( p->m_wnd );
+			if ( dc ) {
+				p->paint( dc, p->m_chain[p->m_front] );
+				ReleaseDC( p->m_wnd, dc );
+			}
+		}
+		return 0;
+	}
+
+	void publish() {
+		unsigned prev = m_ready.exchange( m_back | fresh_frame );
+		if ( prev & fresh_frame ) m_dropped++;
+		m_back = prev & ~fresh_frame;
+		m_rendered++;
+		m_publish_tick = GetTickCount();
+		SetEvent( m_present_event );
+	}
+
 	static LRESULT CALLBACK window_proc( HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam )
 	{
 		window *p = (window *)GetWindowLongPtr( hWnd, GWLP_USERDATA );
@@ -32,10 +100,10 @@ class window {
 			case WM_PAINT: {
 				PAINTSTRUCT	ps;
 				BeginPaint( hWnd, &ps );
-				if ( p->m_scale == 1 ) {
-					SetDIBitsToDevice( ps.hdc, 0, 0, p->m_w, p->m_h, 0, 0, 0, p->m_h, p->m_ptr, &p->m_bi, DIB_RGB_COLORS );
+				if ( p->m_async ) {
+					SetEvent( p->m_present_event ); // present thread repaints
 				} else {
-					StretchDIBits( ps.hdc, 0, 0, p->m_w * p->m_scale, p->m_h * p->m_scale, 0, 0, p->m_w, p->m_h, p->m_ptr, &p->m_bi, DIB_RGB_COLORS, SRCCOPY );
+					p->paint( ps.hdc, p->m_ptr );
 				}
 				EndPaint( hWnd, &ps );
 			} return 0;
@@ -74,8 +142,9 @@ public:
 	typedef void (window::*ftbl_entry)( float, float, int );
 	ftbl_entry	m_event_table[10];
 
-	window( int x, int y, int w, int h, int scale = 1 )
-		: m_w(w), m_h(h),
+	window( int x, int y, int w, int h, int scale = 1, bool async_present = false )
+		: m_async(async_present),
+			m_w(w), m_h(h),
 			m_scale(scale),
 			m_event_table {
 				&window::on_mouse_move,
@@ -109,24 +178,81 @@ public:
 		m_ptr = new uint32_t [m_w * m_h];
 		memset( m_ptr, 255, m_w * m_h * 4 );
 
+		m_back = 0;
+		m_ready = 1;
+		m_front = 2;
+		m_quit = false;
+		m_rendered = m_presented = m_dropped = m_repeated = 0;
+		m_publish_tick = 0;
+		m_present_event = m_present_thread = NULL;
+		for ( int i = 0; i < 3; i++ ) {
+			m_chain[i] = m_async ? new uint32_t [m_w * m_h] : NULL;
+		}
+
 		if ( x == -1 ) x = GetSystemMetrics( SM_CXSCREEN ) / 2 - m_w * scale / 2;
 		if ( y == -1 ) y = GetSystemMetrics( SM_CYSCREEN ) / 2 - m_h * scale / 2;
 
 		m_wnd = CreateWindow( class_name, NULL, WS_POPUP | WS_VISIBLE, x, y, m_w * scale, m_h * scale, NULL, NULL, GetModuleHandle( NULL ), (LPVOID)this );
+
+		if ( m_async ) {
+			HDC dc = GetDC( m_wnd );
+			int hz = GetDeviceCaps( dc, VREFRESH );
+			ReleaseDC( m_wnd, dc );
+			m_refresh_ms = 1000 / (hz > 1 ? hz : 60);
+
+			m_present_event = CreateEvent( NULL, FALSE, FALSE, NULL );
+			m_present_thread = CreateThread( NULL, 0, present_proc, this, 0, NULL );
+		}
 		update();
 	}
 
 	~window() {
 		m_ref_count--;
+		if ( m_async ) {
+			m_quit = true;
+			SetEvent( m_present_event );
+			WaitForSingleObject( m_present_thread, INFINITE );
+			CloseHandle( m_present_thread );
+			CloseHandle( m_present_event );
+			for ( int i = 0; i < 3; i++ ) delete [] m_chain[i];
+		}
 		delete [] m_ptr;
 		if ( !m_ref_count ) {
 			UnregisterClass( class_name, GetModuleHandle( NULL ) );
 		}
 	}
 
+	// present m_ptr; with async present it's copied and m_ptr stays as is
 	void update() {
-		InvalidateRect( m_wnd, NULL, FALSE );
-		UpdateWindow( m_wnd );
+		if ( m_async ) {
+			memcpy( m_chain[m_back], m_ptr, m_w * m_h * 4 );
+			publish();
+		} else {
+			InvalidateRect( m_wnd, NULL, FALSE );
+			UpdateWindow( m_wnd );
+		}
+	}
+
+	// present m_ptr without a copy: m_ptr is handed over and replaced with a free buffer
+	// holding some older frame, use only when every frame is drawn from scratch
+	void swap() {
+		if ( m_async ) {
+			uint32_t *p = m_chain[m_back];
+			m_chain[m_back] = m_ptr;
+			m_ptr = p;
+			publish();
+		} else update();
+	}
+
+	// with async present: true once a refresh interval has passed since the latest frame, a
+	// progressive renderer publishing more often would only copy frames nobody sees
+	bool frame_due() const {
+		return !m_async || GetTickCount() - m_publish_tick >= m_refresh_ms;
+	}
+
+	frame_stats stats() const {
+		frame_stats s = { m_rendered, m_presented, m_dropped, m_repeated };
+		return s;
 	}
 
 	void pixel( int x, int y, uint32_t c ) {